@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libubox/blobmsg_json.h>
+
+#include "../unitd/control.h"
+
+
+static const struct {
+	const char *name;
+	enum unitd_control_cmd cmd;
+} commands[] = {
+	{ "list", UNITD_CONTROL_LIST },
+	{ "start", UNITD_CONTROL_START },
+	{ "stop", UNITD_CONTROL_STOP },
+	{ "restart", UNITD_CONTROL_RESTART },
+	{ "daemon-reload", UNITD_CONTROL_RELOAD },
+};
+
+static const char *const status_names[] = {
+	[UNITD_CONTROL_OK] = "Success",
+	[UNITD_CONTROL_INVALID] = "Invalid request",
+	[UNITD_CONTROL_NOT_FOUND] = "Not found",
+	[UNITD_CONTROL_PERMISSION_DENIED] = "Permission denied",
+	[UNITD_CONTROL_TOO_LARGE] = "Reply too large",
+};
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s list [<service>]\n"
+		"       %s start|stop|restart <service> [<instance>]\n"
+		"       %s daemon-reload\n",
+		prog, prog, prog);
+}
+
+static int
+control_connect(void)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+		.sun_path = UNITD_CONTROL_PATH,
+	};
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	static uint32_t buf[UNITD_CONTROL_MSG_MAX / sizeof(uint32_t)];
+	static struct blob_buf b;
+	struct blob_attr *reply = (struct blob_attr *) buf;
+	enum unitd_control_cmd cmd = 0;
+	unsigned int status;
+	ssize_t len;
+	char *json;
+	size_t i;
+	int fd;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if (!strcmp(argv[1], commands[i].name))
+			cmd = commands[i].cmd;
+	}
+
+	if (!cmd || argc > 4 ||
+	    (cmd == UNITD_CONTROL_LIST ? argc > 3 :
+	     cmd == UNITD_CONTROL_RELOAD ? argc > 2 : argc < 3)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	blob_buf_init(&b, cmd);
+	if (argc > 2)
+		blobmsg_add_string(&b, "service", argv[2]);
+	if (argc > 3)
+		blobmsg_add_string(&b, "instance", argv[3]);
+
+	fd = control_connect();
+	if (fd < 0) {
+		fprintf(stderr, "Failed to connect to unitd: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (send(fd, b.head, blob_pad_len(b.head), 0) < 0) {
+		fprintf(stderr, "Failed to send request: %s\n", strerror(errno));
+		return 1;
+	}
+
+	len = recv(fd, buf, sizeof(buf), 0);
+	if (len < (ssize_t) sizeof(*reply) || blob_raw_len(reply) > (size_t) len) {
+		fprintf(stderr, "Invalid reply from unitd\n");
+		return 1;
+	}
+
+	close(fd);
+	blob_buf_free(&b);
+
+	status = blob_id(reply);
+	if (status != UNITD_CONTROL_OK) {
+		fprintf(stderr, "%s\n", status < sizeof(status_names) / sizeof(status_names[0]) ?
+			status_names[status] : "Unknown error");
+		return 1;
+	}
+
+	if (cmd != UNITD_CONTROL_LIST && cmd != UNITD_CONTROL_RELOAD)
+		return 0;
+
+	json = blobmsg_format_json_indent(reply, true, 0);
+	if (json) {
+		printf("%s\n", json);
+		free(json);
+	}
+
+	return 0;
+}
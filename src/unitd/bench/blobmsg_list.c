@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * Based on "procd" by:
+ * Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ * Copyright (C) 2013 John Crispin <blogic@openwrt.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Compares the flat blobmsg_list from utils.c with the AVL tree based
+ * implementation it replaced, for lists of the sizes found in instance
+ * configurations. The AVL variant is kept here only for this comparison.
+ *
+ * Usage: blobmsg-list-bench [<rounds>]
+ */
+
+#include "../utils.h"
+
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct avl_list_node {
+	struct avl_node avl;
+	struct blob_attr *data;
+};
+
+struct avl_list {
+	struct avl_tree avl;
+};
+
+static void
+avl_list_init(struct avl_list *list)
+{
+	avl_init(&list->avl, avl_strcmp, false, NULL);
+}
+
+static int
+avl_list_fill(struct avl_list *list, void *data, int len, bool array)
+{
+	struct avl_list_node *node;
+	struct blob_attr *cur;
+	int count = 0;
+	int rem = len;
+
+	__blob_for_each_attr(cur, data, rem) {
+		if (!blobmsg_check_attr(cur, !array))
+			continue;
+
+		node = calloc(1, sizeof(*node));
+		if (!node)
+			return -1;
+
+		if (array)
+			node->avl.key = blobmsg_data(cur);
+		else
+			node->avl.key = blobmsg_name(cur);
+		node->data = cur;
+		if (avl_insert(&list->avl, &node->avl)) {
+			free(node);
+			continue;
+		}
+
+		count++;
+	}
+
+	return count;
+}
+
+static void
+avl_list_free(struct avl_list *list)
+{
+	struct avl_list_node *node, *tmp;
+
+	avl_remove_all_elements(&list->avl, node, avl, tmp)
+		free(node);
+}
+
+static bool
+avl_list_equal(struct avl_list *l1, struct avl_list *l2)
+{
+	struct avl_list_node *n1, *n2;
+	int count = l1->avl.count;
+
+	if (count != (int)l2->avl.count)
+		return false;
+
+	n1 = avl_first_element(&l1->avl, n1, avl);
+	n2 = avl_first_element(&l2->avl, n2, avl);
+
+	while (count-- > 0) {
+		unsigned int len;
+
+		len = blob_len(n1->data);
+		if (len != blob_len(n2->data))
+			return false;
+
+		if (memcmp(n1->data, n2->data, len) != 0)
+			return false;
+
+		if (!count)
+			break;
+
+		n1 = avl_next_element(n1, avl);
+		n2 = avl_next_element(n2, avl);
+	}
+
+	return true;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Builds a table like the "env" attribute of an instance, in reverse key order */
+static void
+bench_data(struct blob_buf *b, int n)
+{
+	char key[16], val[32];
+	int i;
+
+	blob_buf_init(b, 0);
+	for (i = n - 1; i >= 0; i--) {
+		snprintf(key, sizeof(key), "VAR%04d", i);
+		snprintf(val, sizeof(val), "value of variable %d", i);
+		blobmsg_add_string(b, key, val);
+	}
+}
+
+static void
+bench_report(const char *op, const char *impl, int n, int rounds, uint64_t start)
+{
+	printf("%-8s %-5s %5d %10.1f ns\n", op, impl, n,
+	       (double) (now_ns() - start) / rounds);
+}
+
+static void
+bench(int n, int rounds)
+{
+	static struct blob_buf b1, b2;
+	struct blobmsg_list f1, f2;
+	struct blobmsg_list_node *fn;
+	struct avl_list a1, a2;
+	struct avl_list_node *an;
+	volatile size_t sum = 0;
+	uint64_t start;
+	int i;
+
+	bench_data(&b1, n);
+	bench_data(&b2, n);
+
+	blobmsg_list_simple_init(&f1);
+	blobmsg_list_simple_init(&f2);
+	avl_list_init(&a1);
+	avl_list_init(&a2);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		blobmsg_list_fill(&f1, blob_data(b1.head), blob_len(b1.head), false);
+		blobmsg_list_free(&f1);
+	}
+	bench_report("fill", "flat", n, rounds, start);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		avl_list_fill(&a1, blob_data(b1.head), blob_len(b1.head), false);
+		avl_list_free(&a1);
+	}
+	bench_report("fill", "avl", n, rounds, start);
+
+	blobmsg_list_fill(&f1, blob_data(b1.head), blob_len(b1.head), false);
+	blobmsg_list_fill(&f2, blob_data(b2.head), blob_len(b2.head), false);
+	avl_list_fill(&a1, blob_data(b1.head), blob_len(b1.head), false);
+	avl_list_fill(&a2, blob_data(b2.head), blob_len(b2.head), false);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++)
+		sum += blobmsg_list_equal(&f1, &f2);
+	bench_report("equal", "flat", n, rounds, start);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++)
+		sum += avl_list_equal(&a1, &a2);
+	bench_report("equal", "avl", n, rounds, start);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		blobmsg_list_for_each(&f1, fn)
+			sum += blob_len(fn->data);
+	}
+	bench_report("iterate", "flat", n, rounds, start);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		avl_for_each_element(&a1.avl, an, avl)
+			sum += blob_len(an->data);
+	}
+	bench_report("iterate", "avl", n, rounds, start);
+
+	blobmsg_list_free(&f1);
+	blobmsg_list_free(&f2);
+	avl_list_free(&a1);
+	avl_list_free(&a2);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1, 4, 16, 64, 256 };
+	int rounds = 100000;
+	size_t i;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+	if (rounds <= 0) {
+		fprintf(stderr, "Usage: %s [<rounds>]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-8s %-5s %5s %13s\n", "op", "impl", "n", "time/round");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench(sizes[i], rounds);
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "unitd.h"
+#include "unit/unit.h"
+
+
+/*
+ * Built-in units activated right after early setup. ubusd is an ordinary
+ * notify-type service; it becomes active when unitd has connected to it,
+ * so units using ubus only need to be ordered after ubus.service, while
+ * everything else starts immediately.
+ */
+static unitd_unit_t boot_target = {
+	.type = UNIT_TYPE_TARGET,
+	.loaded = LOAD_STATE_LOADED,
+	.name = "boot.target",
+	.builtin = true,
+
+	.state = UNIT_STATE_INACTIVE,
+};
+
+static unitd_service_t service_ubus = {
+	.unit = {
+		.type = UNIT_TYPE_SERVICE,
+		.loaded = LOAD_STATE_LOADED,
+		.name = "ubus.service",
+		.builtin = true,
+
+		.state = UNIT_STATE_INACTIVE,
+	},
+
+	.type = SERVICE_TYPE_NOTIFY,
+	.ExecStart = (char *[]){
+		"/sbin/ubusd",
+		NULL,
+	},
+
+	.proc = {},
+};
+
+static unitd_dep_t boot_wants_ubus = {
+	.from = &boot_target,
+	.to = &service_ubus.unit,
+};
+
+
+static void init_unit(unitd_unit_t *unit) {
+	INIT_LIST_HEAD(&unit->requires);
+	INIT_LIST_HEAD(&unit->required_by);
+	INIT_LIST_HEAD(&unit->wants);
+	INIT_LIST_HEAD(&unit->wanted_by);
+	INIT_LIST_HEAD(&unit->conflicts);
+	INIT_LIST_HEAD(&unit->conflicted_by);
+	INIT_LIST_HEAD(&unit->after);
+	INIT_LIST_HEAD(&unit->before);
+}
+
+
+void unitd_boot_ubus_ready(void) {
+	unitd_service_ready(&service_ubus);
+}
+
+void unitd_boot(void) {
+	init_unit(&boot_target);
+	init_unit(&service_ubus.unit);
+
+	list_add_tail(&boot_wants_ubus.list_from, &boot_target.wants);
+	list_add_tail(&boot_wants_ubus.list_to, &service_ubus.unit.wanted_by);
+
+	/* Unit files may add dependencies to the built-in units, but not replace them */
+	unitd_unit_register(&boot_target);
+	unitd_unit_register(&service_ubus.unit);
+	unitd_unit_load();
+
+	unitd_unit_activate(&boot_target);
+}
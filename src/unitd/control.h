@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Protocol of the unitd control socket.
+ *
+ * The socket is a SOCK_SEQPACKET socket served by unitd itself, so it
+ * works without ubusd. Every request and reply is a single packet
+ * holding one blob attribute. For requests, the attribute id is the
+ * command; for replies, it is the status. The payload consists of
+ * blobmsg attributes: "service" and "instance" in requests, and the
+ * result in replies to UNITD_CONTROL_LIST. UNITD_CONTROL_RELOAD rereads
+ * changed unit files and replies with the number of changed units.
+ *
+ * Listing is open to all users; the other commands require root.
+ */
+
+#pragma once
+
+#define UNITD_CONTROL_PATH	"/run/unitd/control"
+#define UNITD_CONTROL_MSG_MAX	65536
+
+enum unitd_control_cmd {
+	UNITD_CONTROL_LIST = 1,
+	UNITD_CONTROL_START,
+	UNITD_CONTROL_STOP,
+	UNITD_CONTROL_RESTART,
+	UNITD_CONTROL_RELOAD,
+	__UNITD_CONTROL_MAX
+};
+
+enum unitd_control_status {
+	UNITD_CONTROL_OK,
+	UNITD_CONTROL_INVALID,
+	UNITD_CONTROL_NOT_FOUND,
+	UNITD_CONTROL_PERMISSION_DENIED,
+	UNITD_CONTROL_TOO_LARGE,
+};
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS	12
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+
+/* Like LZ4, end the input with literals, so the decoder can rely on it */
+#define LZ_LAST_LITERALS	5
+#define LZ_MATCH_LIMIT		12
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *
+lz_put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+
+	*op++ = len;
+	return op;
+}
+
+/* Returns NULL if the sequence does not fit */
+static uint8_t *
+lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+		size_t offset, size_t match_len)
+{
+	size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+	uint8_t *token;
+
+	if ((size_t) (oend - op) < lit_len + lit_len / 255 + ml / 255 + 5)
+		return NULL;
+
+	token = op++;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = lz_put_length(op, lit_len - 15);
+
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+
+	*token |= ml < 15 ? ml : 15;
+	if (ml >= 15)
+		op = lz_put_length(op, ml - 15);
+
+	return op;
+}
+
+size_t
+lz_compress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = {};
+	const uint8_t *base = src, *ip = src, *anchor = src, *end = base + len;
+	uint8_t *op = dst, *oend = op + dst_len;
+
+	if (len > LZ_MATCH_LIMIT) {
+		const uint8_t *mflimit = end - LZ_MATCH_LIMIT;
+		const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t v = lz_read32(ip);
+			unsigned h = lz_hash(v);
+			const uint8_t *ref = base + table[h];
+			size_t ml;
+
+			table[h] = ip - base;
+
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != v) {
+				ip++;
+				continue;
+			}
+
+			ml = LZ_MIN_MATCH;
+			while (ip + ml < matchlimit && ref[ml] == ip[ml])
+				ml++;
+
+			op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, ml);
+			if (!op)
+				return 0;
+
+			ip += ml;
+			anchor = ip;
+		}
+	}
+
+	op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *) dst;
+}
+
+static bool
+lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/* Returns the decompressed size, or 0 if the input is malformed */
+size_t
+lz_decompress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + dst_len;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4, ml = token & 15, offset;
+
+		if (lit == 15 && !lz_get_length(&ip, iend, &lit))
+			return 0;
+
+		if ((size_t) (iend - ip) < lit || (size_t) (oend - op) < lit)
+			return 0;
+
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* The last sequence consists of literals only */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return 0;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (!offset || offset > (size_t) (op - (uint8_t *) dst))
+			return 0;
+
+		if (ml == 15 && !lz_get_length(&ip, iend, &ml))
+			return 0;
+		ml += LZ_MIN_MATCH;
+
+		if ((size_t) (oend - op) < ml)
+			return 0;
+
+		/* Matches may overlap their own output */
+		for (; ml; ml--, op++)
+			*op = op[-offset];
+	}
+
+	return op - (uint8_t *) dst;
+}
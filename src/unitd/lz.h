@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Small LZ77 block compressor using the LZ4 block format. Blocks are
+ * self-contained; matches never reach back more than 64 KiB.
+ */
+
+/* Maximum compressed size of len bytes of input */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t dst_len);
+size_t lz_decompress(const void *src, size_t len, void *dst, size_t dst_len);
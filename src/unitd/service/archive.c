@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../unitd.h"
+#include "../lz.h"
+
+#include "journal.h"
+#include "archive.h"
+
+/*
+ * The archive stores journal records in numbered segment files. Each
+ * segment starts with the boot ID it was written in, followed by
+ * independently compressed blocks of records, so a block cut short by a
+ * crash only loses the records it contains. When the archive grows beyond
+ * its budget, the oldest segments are deleted.
+ */
+
+#define ARCHIVE_BUDGET		(1024 * 1024)
+#define ARCHIVE_SEGMENT_SIZE	(128 * 1024)
+
+#define ARCHIVE_MAGIC		"UJA1"
+#define ARCHIVE_BLOCK_MAGIC	0x4b4c424a
+#define ARCHIVE_BOOT_ID_LEN	36
+
+struct archive_header {
+	char magic[4];
+	char boot_id[ARCHIVE_BOOT_ID_LEN];
+};
+
+/* Blocks with len == raw_len are stored uncompressed */
+struct archive_block {
+	uint32_t magic;
+	uint32_t raw_len;
+	uint32_t len;
+	uint32_t hash;
+};
+
+struct archive_segment {
+	uint32_t num;
+	size_t size;
+};
+
+static char boot_id[ARCHIVE_BOOT_ID_LEN];
+static bool enabled;
+static int fd = -1;
+
+static struct archive_segment *segments;
+static size_t n_segments;
+static size_t total;
+
+/* Records are read in place, so the buffer must be aligned like them */
+static char raw[ARCHIVE_BLOCK_SIZE]
+	__attribute__((aligned(__alignof__(struct journal_record))));
+static char packed[LZ_BOUND(ARCHIVE_BLOCK_SIZE)];
+
+static uint32_t
+archive_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t h = 2166136261U;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static void
+archive_path(char *path, size_t len, uint32_t num)
+{
+	snprintf(path, len, ARCHIVE_DIR "/%08x.seg", num);
+}
+
+static int
+archive_filter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+
+	return len == 12 && !strcmp(d->d_name + 8, ".seg");
+}
+
+static bool
+archive_scan(void)
+{
+	struct dirent **list;
+	struct stat st;
+	char path[64];
+	int i, n;
+
+	n = scandir(ARCHIVE_DIR, &list, archive_filter, alphasort);
+	if (n < 0)
+		return false;
+
+	segments = calloc(n + 1, sizeof(*segments));
+	if (!segments) {
+		while (n--)
+			free(list[n]);
+		free(list);
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct archive_segment *seg = &segments[n_segments];
+
+		seg->num = strtoul(list[i]->d_name, NULL, 16);
+		free(list[i]);
+
+		archive_path(path, sizeof(path), seg->num);
+		if (stat(path, &st))
+			continue;
+
+		seg->size = st.st_size;
+		total += seg->size;
+		n_segments++;
+	}
+	free(list);
+
+	return true;
+}
+
+static void
+archive_evict(void)
+{
+	char path[64];
+
+	/* The current segment is never deleted */
+	while (total > ARCHIVE_BUDGET && n_segments > 1) {
+		archive_path(path, sizeof(path), segments[0].num);
+		unlink(path);
+
+		total -= segments[0].size;
+		n_segments--;
+		memmove(segments, segments + 1, n_segments * sizeof(*segments));
+	}
+}
+
+static bool
+archive_open_segment(void)
+{
+	struct archive_segment *seg, *tmp;
+	struct archive_header hdr;
+	char path[64];
+
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	tmp = realloc(segments, (n_segments + 1) * sizeof(*segments));
+	if (!tmp)
+		return false;
+	segments = tmp;
+
+	seg = &segments[n_segments];
+	seg->num = n_segments ? segments[n_segments - 1].num + 1 : 0;
+	seg->size = 0;
+
+	archive_path(path, sizeof(path), seg->num);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		ERROR("Failed to create journal segment %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	memcpy(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+	memcpy(hdr.boot_id, boot_id, sizeof(hdr.boot_id));
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(fd);
+		fd = -1;
+		unlink(path);
+		return false;
+	}
+
+	seg->size = sizeof(hdr);
+	total += seg->size;
+	n_segments++;
+
+	return true;
+}
+
+void
+archive_append(const void *data, size_t len)
+{
+	struct archive_block block = {
+		.magic = ARCHIVE_BLOCK_MAGIC,
+		.raw_len = len,
+	};
+	struct iovec iov[2];
+	struct archive_segment *seg;
+	ssize_t ret;
+
+	if (!enabled || !len || len > ARCHIVE_BLOCK_SIZE)
+		return;
+
+	if (fd < 0 || segments[n_segments - 1].size >= ARCHIVE_SEGMENT_SIZE) {
+		if (!archive_open_segment())
+			return;
+	}
+
+	block.len = lz_compress(data, len, packed, sizeof(packed));
+	if (block.len && block.len < len) {
+		iov[1].iov_base = packed;
+	} else {
+		block.len = len;
+		iov[1].iov_base = (void *) data;
+	}
+	iov[1].iov_len = block.len;
+	block.hash = archive_hash(iov[1].iov_base, block.len);
+
+	iov[0].iov_base = &block;
+	iov[0].iov_len = sizeof(block);
+
+	ret = writev(fd, iov, ARRAY_SIZE(iov));
+	if (ret < 0) {
+		ERROR("Failed to write journal segment: %s\n", strerror(errno));
+		return;
+	}
+
+	seg = &segments[n_segments - 1];
+	seg->size += ret;
+	total += ret;
+
+	archive_evict();
+}
+
+void
+archive_sync(void)
+{
+	if (fd >= 0)
+		fdatasync(fd);
+}
+
+static bool
+archive_read_header(uint32_t num, char *id)
+{
+	struct archive_header hdr;
+	char path[64];
+	int sfd;
+	bool ret;
+
+	archive_path(path, sizeof(path), num);
+	sfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (sfd < 0)
+		return false;
+
+	ret = read(sfd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		!memcmp(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+	if (ret)
+		memcpy(id, hdr.boot_id, sizeof(hdr.boot_id));
+
+	close(sfd);
+	return ret;
+}
+
+static void
+archive_read_segment(uint32_t num, archive_cb cb, void *priv)
+{
+	struct archive_block block;
+	struct stat st;
+	char path[64], *buf, *p, *end;
+	size_t len, off;
+	int sfd;
+
+	archive_path(path, sizeof(path), num);
+	sfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (sfd < 0)
+		return;
+
+	if (fstat(sfd, &st) || !(buf = malloc(st.st_size))) {
+		close(sfd);
+		return;
+	}
+
+	len = read(sfd, buf, st.st_size);
+	close(sfd);
+
+	if ((ssize_t) len < (ssize_t) sizeof(struct archive_header))
+		goto out;
+
+	p = buf + sizeof(struct archive_header);
+	end = buf + len;
+
+	/* Stop at the first damaged block, usually the last one before a crash */
+	while ((size_t) (end - p) >= sizeof(block)) {
+		/* Blocks are stored back to back, so headers may be unaligned */
+		memcpy(&block, p, sizeof(block));
+		p += sizeof(block);
+
+		if (block.magic != ARCHIVE_BLOCK_MAGIC ||
+		    block.raw_len > ARCHIVE_BLOCK_SIZE ||
+		    block.len > block.raw_len ||
+		    block.len > (size_t) (end - p) ||
+		    archive_hash(p, block.len) != block.hash)
+			break;
+
+		if (block.len == block.raw_len)
+			memcpy(raw, p, block.len);
+		else if (lz_decompress(p, block.len, raw, sizeof(raw)) != block.raw_len)
+			break;
+
+		p += block.len;
+
+		for (off = 0; off + sizeof(struct journal_record) <= block.raw_len;) {
+			struct journal_record *r = (struct journal_record *) (raw + off);
+
+			if (r->len < sizeof(*r) || r->len % 8 || r->len > block.raw_len - off)
+				break;
+
+			off += r->len;
+
+			if (sizeof(*r) + r->service_len + r->instance_len + r->msg_len + 3 > r->len)
+				continue;
+
+			cb(r, priv);
+		}
+	}
+
+out:
+	free(buf);
+}
+
+/*
+ * Calls cb for all archived records of a boot; boot 0 is the current
+ * boot, -1 the one before, and so on.
+ */
+bool
+archive_read(int boot, archive_cb cb, void *priv)
+{
+	char (*ids)[ARCHIVE_BOOT_ID_LEN];
+	size_t i, n = 0;
+	int target = -1;
+
+	if (!enabled || boot > 0)
+		return false;
+
+	ids = calloc(n_segments + 1, sizeof(*ids));
+	if (!ids)
+		return false;
+
+	for (i = 0; i < n_segments; i++) {
+		if (!archive_read_header(segments[i].num, ids[i]))
+			memset(ids[i], 0, sizeof(ids[i]));
+	}
+
+	/* Count boots backwards from the current one */
+	memcpy(ids[n_segments], boot_id, sizeof(boot_id));
+	for (i = n_segments + 1; i-- > 0;) {
+		if (i == n_segments || memcmp(ids[i], ids[i + 1], sizeof(ids[i]))) {
+			if (-(int) n++ == boot)
+				target = i;
+		}
+	}
+
+	if (target < 0) {
+		free(ids);
+		return false;
+	}
+
+	for (i = 0; i < n_segments; i++) {
+		if (!memcmp(ids[i], ids[target], sizeof(ids[i])))
+			archive_read_segment(segments[i].num, cb, priv);
+	}
+
+	free(ids);
+	return true;
+}
+
+bool
+archive_init(void)
+{
+	struct stat st;
+	int bfd;
+
+	if (stat(ARCHIVE_DIR, &st) || !S_ISDIR(st.st_mode))
+		return false;
+
+	bfd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (bfd < 0)
+		return false;
+
+	if (read(bfd, boot_id, sizeof(boot_id)) != sizeof(boot_id)) {
+		close(bfd);
+		return false;
+	}
+	close(bfd);
+
+	if (!archive_scan())
+		return false;
+
+	enabled = true;
+	archive_evict();
+
+	return true;
+}
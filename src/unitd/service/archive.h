@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Persistent storage is only used when this directory exists */
+#define ARCHIVE_DIR		"/var/log/unitd"
+
+/* Maximum amount of uncompressed record data in a single block */
+#define ARCHIVE_BLOCK_SIZE	(64 * 1024)
+
+struct journal_record;
+
+typedef void (*archive_cb)(struct journal_record *r, void *priv);
+
+bool archive_init(void);
+void archive_append(const void *data, size_t len);
+void archive_sync(void);
+bool archive_read(int boot, archive_cb cb, void *priv);
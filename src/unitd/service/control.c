@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../unitd.h"
+#include "../control.h"
+#include "../unit/unit.h"
+
+#include "service.h"
+#include "instance.h"
+#include "control.h"
+
+#define CONTROL_CLIENTS_MAX 16
+#define CONTROL_CLIENTS_UID_MAX 4
+
+struct control_client {
+	struct list_head list;
+	struct uloop_fd fd;
+	struct ucred cred;
+};
+
+enum {
+	CONTROL_ATTR_SERVICE,
+	CONTROL_ATTR_INSTANCE,
+	__CONTROL_ATTR_MAX
+};
+
+static const struct blobmsg_policy control_attrs[__CONTROL_ATTR_MAX] = {
+	[CONTROL_ATTR_SERVICE] = { "service", BLOBMSG_TYPE_STRING },
+	[CONTROL_ATTR_INSTANCE] = { "instance", BLOBMSG_TYPE_STRING },
+};
+
+static struct uloop_fd control_fd;
+static LIST_HEAD(clients);
+static unsigned int n_clients;
+static struct blob_buf b, reply;
+
+static void
+control_client_free(struct control_client *c)
+{
+	uloop_fd_delete(&c->fd);
+	close(c->fd.fd);
+	list_del(&c->list);
+	free(c);
+	n_clients--;
+}
+
+/* Find room for a client of the given user, root may evict other users */
+static bool
+control_client_admit(uid_t uid)
+{
+	struct control_client *c, *victim = NULL;
+	unsigned int n_uid = 0;
+
+	list_for_each_entry(c, &clients, list) {
+		if (c->cred.uid == uid)
+			n_uid++;
+		else if (c->cred.uid != 0)
+			victim = c;
+	}
+
+	if (uid != 0 && n_uid >= CONTROL_CLIENTS_UID_MAX)
+		return false;
+
+	if (n_clients < CONTROL_CLIENTS_MAX)
+		return true;
+
+	if (uid != 0 || !victim)
+		return false;
+
+	/* clients are added at the head, so this is the oldest one */
+	DEBUG(2, "Dropping control client of uid %u\n", (unsigned) victim->cred.uid);
+	control_client_free(victim);
+	return true;
+}
+
+static int
+control_list(const char *name)
+{
+	struct service *s;
+	struct service_instance *in;
+	void *cs, *ci;
+
+	avl_for_each_element(&services, s, avl) {
+		if (name && strcmp(name, s->name))
+			continue;
+
+		cs = blobmsg_open_table(&b, s->name);
+		ci = blobmsg_open_table(&b, "instances");
+		vlist_for_each_element(&s->instances, in, node)
+			instance_dump(&b, in, (1U << INSTANCE_DUMP_RUNNING) | (1U << INSTANCE_DUMP_PID));
+		blobmsg_close_table(&b, ci);
+		blobmsg_close_table(&b, cs);
+	}
+
+	if (name && !avl_find(&services, name))
+		return UNITD_CONTROL_NOT_FOUND;
+
+	return UNITD_CONTROL_OK;
+}
+
+static int
+control_action(int cmd, const char *name, const char *instance)
+{
+	struct service *s;
+	struct service_instance *in;
+	bool found = false;
+
+	s = avl_find_element(&services, name, s, avl);
+	if (!s)
+		return UNITD_CONTROL_NOT_FOUND;
+
+	vlist_for_each_element(&s->instances, in, node) {
+		if (instance && strcmp(instance, in->name))
+			continue;
+
+		found = true;
+		switch (cmd) {
+		case UNITD_CONTROL_START:
+			instance_start(in);
+			break;
+		case UNITD_CONTROL_STOP:
+			instance_stop(in);
+			break;
+		case UNITD_CONTROL_RESTART:
+			if (in->proc.pending)
+				instance_restart(in);
+			else
+				instance_start(in);
+			break;
+		}
+	}
+
+	return found ? UNITD_CONTROL_OK : UNITD_CONTROL_NOT_FOUND;
+}
+
+static int
+control_handle(struct control_client *c, struct blob_attr *msg)
+{
+	struct blob_attr *tb[__CONTROL_ATTR_MAX];
+	const char *name = NULL, *instance = NULL;
+	int cmd = blob_id(msg);
+
+	if (cmd <= 0 || cmd >= __UNITD_CONTROL_MAX)
+		return UNITD_CONTROL_INVALID;
+
+	if (cmd != UNITD_CONTROL_LIST && c->cred.uid != 0)
+		return UNITD_CONTROL_PERMISSION_DENIED;
+
+	blobmsg_parse(control_attrs, __CONTROL_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[CONTROL_ATTR_SERVICE])
+		name = blobmsg_data(tb[CONTROL_ATTR_SERVICE]);
+	if (tb[CONTROL_ATTR_INSTANCE])
+		instance = blobmsg_data(tb[CONTROL_ATTR_INSTANCE]);
+
+	if (cmd == UNITD_CONTROL_LIST)
+		return control_list(name);
+
+	if (cmd == UNITD_CONTROL_RELOAD) {
+		DEBUG(2, "Control reload request from uid %u\n", (unsigned) c->cred.uid);
+		blobmsg_add_u32(&b, "changed", unitd_unit_reload());
+		return UNITD_CONTROL_OK;
+	}
+
+	if (!name)
+		return UNITD_CONTROL_INVALID;
+
+	DEBUG(2, "Control request %d for %s from uid %u\n", cmd, name, (unsigned) c->cred.uid);
+
+	return control_action(cmd, name, instance);
+}
+
+static void
+control_client_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	static uint32_t buf[UNITD_CONTROL_MSG_MAX / sizeof(uint32_t)];
+	struct control_client *c = container_of(fd, struct control_client, fd);
+	struct blob_attr *msg = (struct blob_attr *) buf;
+	ssize_t len;
+	int status;
+
+	while (true) {
+		len = recv(fd->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return;
+		if (len <= 0) {
+			control_client_free(c);
+			return;
+		}
+
+		blob_buf_init(&b, 0);
+
+		if ((size_t) len < sizeof(*msg) || blob_raw_len(msg) < sizeof(*msg) ||
+		    blob_raw_len(msg) > (size_t) len)
+			status = UNITD_CONTROL_INVALID;
+		else
+			status = control_handle(c, msg);
+
+		/* The reply is sent as a blob with the status as id */
+		blob_buf_init(&reply, status);
+		if (blob_pad_len(b.head) > UNITD_CONTROL_MSG_MAX)
+			blob_buf_init(&reply, UNITD_CONTROL_TOO_LARGE);
+		else
+			blob_put_raw(&reply, blob_data(b.head), blob_len(b.head));
+
+		if (send(fd->fd, reply.head, blob_pad_len(reply.head), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			control_client_free(c);
+			return;
+		}
+	}
+}
+
+static void
+control_accept_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	struct control_client *c;
+	socklen_t len;
+	int cfd;
+
+	while (true) {
+		cfd = accept4(fd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0)
+			return;
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(cfd);
+			continue;
+		}
+
+		len = sizeof(c->cred);
+		if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &c->cred, &len)) {
+			ERROR("Failed to get control peer credentials: %s\n", strerror(errno));
+			close(cfd);
+			free(c);
+			continue;
+		}
+
+		if (!control_client_admit(c->cred.uid)) {
+			close(cfd);
+			free(c);
+			continue;
+		}
+
+		c->fd.fd = cfd;
+		c->fd.cb = control_client_cb;
+		uloop_fd_add(&c->fd, ULOOP_READ);
+		list_add(&c->list, &clients);
+		n_clients++;
+	}
+}
+
+void
+control_init(void)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+		.sun_path = UNITD_CONTROL_PATH,
+	};
+
+	mkdir("/run/unitd", 0755);
+	unlink(UNITD_CONTROL_PATH);
+
+	control_fd.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control_fd.fd < 0) {
+		ERROR("Failed to create control socket: %s\n", strerror(errno));
+		return;
+	}
+
+	/* Access is checked per request using the peer credentials */
+	if (bind(control_fd.fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    chmod(UNITD_CONTROL_PATH, 0666) ||
+	    listen(control_fd.fd, 8)) {
+		ERROR("Failed to set up control socket: %s\n", strerror(errno));
+		close(control_fd.fd);
+		control_fd.fd = -1;
+		return;
+	}
+
+	control_fd.cb = control_accept_cb;
+	uloop_fd_add(&control_fd, ULOOP_READ);
+}
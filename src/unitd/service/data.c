@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libubox/avl-cmp.h>
+
+#include "../unitd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "data.h"
+
+
+/*
+ * Index from data type to the instances providing data of that type, so
+ * get_data requests for a type do not have to walk all services. The
+ * references of a type are sorted by service and instance name, which
+ * keeps the entries of each service together for the reply.
+ */
+struct data_type {
+	struct avl_node avl;
+	struct avl_tree refs;
+};
+
+struct data_ref {
+	struct avl_node avl;
+	struct list_head list;
+	struct data_type *type;
+	struct blob_attr *data;
+};
+
+static struct avl_tree data_types;
+
+static int
+data_ref_cmp(const void *k1, const void *k2, UNUSED void *ptr)
+{
+	const struct service_instance *in1 = k1, *in2 = k2;
+	int ret;
+
+	ret = strcmp(in1->srv->name, in2->srv->name);
+	if (ret)
+		return ret;
+
+	return strcmp(in1->name, in2->name);
+}
+
+static struct data_type *
+data_type_get(const char *name)
+{
+	struct data_type *type;
+	char *new_name;
+
+	type = avl_find_element(&data_types, name, type, avl);
+	if (type)
+		return type;
+
+	type = calloc_a(sizeof(*type), &new_name, strlen(name) + 1);
+	if (!type)
+		return NULL;
+
+	type->avl.key = strcpy(new_name, name);
+	avl_init(&type->refs, data_ref_cmp, true, NULL);
+	avl_insert(&data_types, &type->avl);
+
+	return type;
+}
+
+void
+data_index(struct service_instance *in)
+{
+	struct blobmsg_list_node *var;
+	struct data_type *type;
+	struct data_ref *ref;
+
+	data_unindex(in);
+
+	blobmsg_list_for_each(&in->data, var) {
+		type = data_type_get(blobmsg_name(var->data));
+		if (!type)
+			continue;
+
+		ref = calloc(1, sizeof(*ref));
+		if (!ref)
+			continue;
+
+		ref->avl.key = in;
+		ref->type = type;
+		ref->data = var->data;
+		avl_insert(&type->refs, &ref->avl);
+		list_add_tail(&ref->list, &in->data_refs);
+	}
+}
+
+void
+data_unindex(struct service_instance *in)
+{
+	struct data_ref *ref, *tmp;
+
+	list_for_each_entry_safe(ref, tmp, &in->data_refs, list) {
+		avl_delete(&ref->type->refs, &ref->avl);
+		if (avl_is_empty(&ref->type->refs)) {
+			avl_delete(&data_types, &ref->type->avl);
+			free(ref->type);
+		}
+
+		list_del(&ref->list);
+		free(ref);
+	}
+}
+
+void
+data_dump_type(struct blob_buf *b, const char *name, const char *instance,
+	       const char *type)
+{
+	const struct service_instance *in, *last = NULL;
+	struct data_type *t;
+	struct data_ref *ref;
+	void *cs = NULL, *ci = NULL;
+
+	t = avl_find_element(&data_types, type, t, avl);
+	if (!t)
+		return;
+
+	avl_for_each_element(&t->refs, ref, avl) {
+		in = ref->avl.key;
+
+		if (name && strcmp(name, in->srv->name))
+			continue;
+		if (instance && strcmp(instance, in->name))
+			continue;
+
+		if (in != last) {
+			if (ci)
+				blobmsg_close_table(b, ci);
+			if (cs && (!last || last->srv != in->srv)) {
+				blobmsg_close_table(b, cs);
+				cs = NULL;
+			}
+			if (!cs)
+				cs = blobmsg_open_table(b, in->srv->name);
+			ci = blobmsg_open_table(b, in->name);
+			last = in;
+		}
+
+		blobmsg_add_blob(b, ref->data);
+	}
+
+	if (ci)
+		blobmsg_close_table(b, ci);
+	if (cs)
+		blobmsg_close_table(b, cs);
+}
+
+void
+data_init(void)
+{
+	avl_init(&data_types, avl_strcmp, false, NULL);
+}
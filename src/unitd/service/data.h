@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <libubox/blob.h>
+
+struct service_instance;
+
+void data_init(void);
+void data_index(struct service_instance *in);
+void data_unindex(struct service_instance *in);
+void data_dump_type(struct blob_buf *b, const char *name, const char *instance,
+		    const char *type);
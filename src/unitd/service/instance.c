@@ -25,7 +25,6 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <pwd.h>
-#include <libgen.h>
 #include <unistd.h>
 
 #include <libubox/md5.h>
@@ -34,6 +33,14 @@
 
 #include "service.h"
 #include "instance.h"
+#include "pressure.h"
+#include "notify.h"
+#include "logger.h"
+#include "wait.h"
+#include "data.h"
+#include "status.h"
+
+#define LISTEN_FDS_START 3
 
 
 enum {
@@ -49,6 +56,12 @@ enum {
 	INSTANCE_ATTR_USER,
 	INSTANCE_ATTR_STDOUT,
 	INSTANCE_ATTR_STDERR,
+	INSTANCE_ATTR_RELOAD_SIGNAL,
+	INSTANCE_ATTR_PRESSURE,
+	INSTANCE_ATTR_FDSTORE,
+	INSTANCE_ATTR_RELOAD,
+	INSTANCE_ATTR_LOG_LIMIT,
+	INSTANCE_ATTR_LOG_FILE,
 	__INSTANCE_ATTR_MAX
 };
 
@@ -65,6 +78,88 @@ static const struct blobmsg_policy instance_attr[__INSTANCE_ATTR_MAX] = {
 	[INSTANCE_ATTR_USER] = { "user", BLOBMSG_TYPE_STRING },
 	[INSTANCE_ATTR_STDOUT] = { "stdout", BLOBMSG_TYPE_BOOL },
 	[INSTANCE_ATTR_STDERR] = { "stderr", BLOBMSG_TYPE_BOOL },
+	[INSTANCE_ATTR_RELOAD_SIGNAL] = { "reload_signal", BLOBMSG_TYPE_INT32 },
+	[INSTANCE_ATTR_PRESSURE] = { "pressure", BLOBMSG_TYPE_TABLE },
+	[INSTANCE_ATTR_FDSTORE] = { "fdstore", BLOBMSG_TYPE_INT32 },
+	[INSTANCE_ATTR_RELOAD] = { "reload", BLOBMSG_TYPE_ARRAY },
+	[INSTANCE_ATTR_LOG_LIMIT] = { "log_limit", BLOBMSG_TYPE_TABLE },
+	[INSTANCE_ATTR_LOG_FILE] = { "log_file", BLOBMSG_TYPE_TABLE },
+};
+
+enum {
+	PRESSURE_ATTR_ACTION,
+	PRESSURE_ATTR_CGROUP,
+	__PRESSURE_ATTR_MAX
+};
+
+static const struct blobmsg_policy pressure_attr[__PRESSURE_ATTR_MAX] = {
+	[PRESSURE_ATTR_ACTION] = { "action", BLOBMSG_TYPE_STRING },
+	[PRESSURE_ATTR_CGROUP] = { "cgroup", BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	LOG_LIMIT_ATTR_RATE,
+	LOG_LIMIT_ATTR_BURST,
+	__LOG_LIMIT_ATTR_MAX
+};
+
+static const struct blobmsg_policy log_limit_attr[__LOG_LIMIT_ATTR_MAX] = {
+	[LOG_LIMIT_ATTR_RATE] = { "rate", BLOBMSG_TYPE_INT32 },
+	[LOG_LIMIT_ATTR_BURST] = { "burst", BLOBMSG_TYPE_INT32 },
+};
+
+enum {
+	LOG_FILE_ATTR_PATH,
+	LOG_FILE_ATTR_SIZE,
+	LOG_FILE_ATTR_ROTATE,
+	LOG_FILE_ATTR_RAW,
+	__LOG_FILE_ATTR_MAX
+};
+
+static const struct blobmsg_policy log_file_attr[__LOG_FILE_ATTR_MAX] = {
+	[LOG_FILE_ATTR_PATH] = { "path", BLOBMSG_TYPE_STRING },
+	[LOG_FILE_ATTR_SIZE] = { "size", BLOBMSG_TYPE_INT32 },
+	[LOG_FILE_ATTR_ROTATE] = { "rotate", BLOBMSG_TYPE_INT32 },
+	[LOG_FILE_ATTR_RAW] = { "raw", BLOBMSG_TYPE_BOOL },
+};
+
+static const char * const pressure_actions[] = {
+	[PRESSURE_ACTION_NONE] = "none",
+	[PRESSURE_ACTION_NOTIFY] = "notify",
+	[PRESSURE_ACTION_RELOAD] = "reload",
+	[PRESSURE_ACTION_STOP] = "stop",
+};
+
+const struct instance_field_info instance_fields[__INSTANCE_FIELD_MAX] = {
+	[INSTANCE_FIELD_COMMAND] = { "command", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_ENV] = { "env", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_DATA] = { "data", INSTANCE_ACTION_NONE },
+	[INSTANCE_FIELD_NETDEV] = { "netdev", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_FILE] = { "file", INSTANCE_ACTION_RELOAD },
+	[INSTANCE_FIELD_NICE] = { "nice", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_USER] = { "user", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_LIMITS] = { "limits", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_ERROR] = { "error", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_RESPAWN] = { "respawn", INSTANCE_ACTION_NONE },
+	[INSTANCE_FIELD_STDIO] = { "stdio", INSTANCE_ACTION_RESTART },
+	[INSTANCE_FIELD_RELOAD] = { "reload", INSTANCE_ACTION_NONE },
+	[INSTANCE_FIELD_PRESSURE] = { "pressure", INSTANCE_ACTION_NONE },
+	[INSTANCE_FIELD_FDSTORE] = { "fdstore", INSTANCE_ACTION_NONE },
+	[INSTANCE_FIELD_LOG] = { "log", INSTANCE_ACTION_NONE },
+};
+
+static const char * const instance_dump_names[__INSTANCE_DUMP_MAX] = {
+	[INSTANCE_DUMP_RUNNING] = "running",
+	[INSTANCE_DUMP_PID] = "pid",
+	[INSTANCE_DUMP_COMMAND] = "command",
+	[INSTANCE_DUMP_ERRORS] = "errors",
+	[INSTANCE_DUMP_ENV] = "env",
+	[INSTANCE_DUMP_DATA] = "data",
+	[INSTANCE_DUMP_LIMITS] = "limits",
+	[INSTANCE_DUMP_RESPAWN] = "respawn",
+	[INSTANCE_DUMP_FDSTORE] = "fdstore",
+	[INSTANCE_DUMP_PRESSURE] = "pressure",
+	[INSTANCE_DUMP_LOG] = "log",
 };
 
 struct instance_netdev {
@@ -138,6 +233,49 @@ instance_limits(const char *limit, const char *value)
 	}
 }
 
+static void
+instance_pass_fds(struct service_instance *in)
+{
+	struct instance_fd *f;
+	char *names, *p;
+	int *fds, i = 0, n = 0;
+	size_t len = 1;
+	char buf[16];
+
+	if (!in->n_fdstore)
+		return;
+
+	/* Move the stored fds out of the target range first */
+	fds = alloca(sizeof(int) * in->n_fdstore);
+	list_for_each_entry(f, &in->fdstore, list) {
+		fds[i++] = fcntl(f->fd, F_DUPFD_CLOEXEC, LISTEN_FDS_START + in->n_fdstore);
+		len += strlen(f->name) + 1;
+	}
+
+	/* fds that could not be moved are left out, so the range has no holes */
+	names = alloca(len);
+	*names = 0;
+	p = names;
+	i = 0;
+	list_for_each_entry(f, &in->fdstore, list) {
+		int fd = fds[i++];
+
+		if (fd < 0 || dup2(fd, LISTEN_FDS_START + n) < 0)
+			continue;
+
+		if (n)
+			*p++ = ':';
+		p = stpcpy(p, f->name);
+		n++;
+	}
+
+	snprintf(buf, sizeof(buf), "%d", n);
+	setenv("LISTEN_FDS", buf, 1);
+	snprintf(buf, sizeof(buf), "%d", (int)getpid());
+	setenv("LISTEN_PID", buf, 1);
+	setenv("LISTEN_FDNAMES", names, 1);
+}
+
 static void
 instance_run(struct service_instance *in, int _stdout, int _stderr)
 {
@@ -159,6 +297,9 @@ instance_run(struct service_instance *in, int _stdout, int _stderr)
 	blobmsg_list_for_each(&in->limits, var)
 		instance_limits(blobmsg_name(var->data), blobmsg_data(var->data));
 
+	if (in->fdstore_max)
+		setenv("NOTIFY_SOCKET", NOTIFY_SOCKET_PATH, 1);
+
 	argv = alloca(sizeof(char *) * argc);
 	argc = 0;
 
@@ -188,6 +329,8 @@ instance_run(struct service_instance *in, int _stdout, int _stderr)
 		closefd(_stderr);
 	}
 
+	instance_pass_fds(in);
+
 	if (in->gid && setgid(in->gid)) {
 		ERROR("failed to set group id %d: %d (%s)\n", in->gid, errno, strerror(errno));
 		exit(127);
@@ -202,19 +345,22 @@ instance_run(struct service_instance *in, int _stdout, int _stderr)
 }
 
 static void
-instance_free_stdio(struct service_instance *in)
+instance_ident(struct service_instance *in)
 {
-	if (in->_stdout.fd.fd > -1) {
-		ustream_free(&in->_stdout.stream);
-		close(in->_stdout.fd.fd);
-		in->_stdout.fd.fd = -1;
-	}
+	const char *arg0 = blobmsg_data(blobmsg_data(in->command));
+	const char *slash = strrchr(arg0, '/');
 
-	if (in->_stderr.fd.fd > -1) {
-		ustream_free(&in->_stderr.stream);
-		close(in->_stderr.fd.fd);
-		in->_stderr.fd.fd = -1;
-	}
+	if (slash && slash[1])
+		arg0 = slash + 1;
+
+	snprintf(in->ident, sizeof(in->ident), "%s[%d]", arg0, in->proc.pid);
+}
+
+static void
+instance_free_stdio(struct service_instance *in)
+{
+	logger_stream_close(&in->_stdout);
+	logger_stream_close(&in->_stderr);
 }
 
 void
@@ -224,7 +370,7 @@ instance_start(struct service_instance *in)
 	int opipe[2] = { -1, -1 };
 	int epipe[2] = { -1, -1 };
 
-	if (!avl_is_empty(&in->errors.avl)) {
+	if (!blobmsg_list_empty(&in->errors)) {
 		LOG("Not starting instance %s::%s, an error was indicated\n", in->srv->name, in->name);
 		return;
 	}
@@ -232,6 +378,9 @@ instance_start(struct service_instance *in)
 	if (in->proc.pending)
 		return;
 
+	if (service_start_deferred(in))
+		return;
+
 	instance_free_stdio(in);
 	if (in->_stdout.fd.fd > -2) {
 		if (pipe(opipe)) {
@@ -248,6 +397,7 @@ instance_start(struct service_instance *in)
 	}
 
 	in->restart = false;
+	in->ready = false;
 	in->halt = !in->respawn;
 
 	if (!in->valid)
@@ -267,63 +417,29 @@ instance_start(struct service_instance *in)
 
 	DEBUG(2, "Started instance %s::%s\n", in->srv->name, in->name);
 	in->proc.pid = pid;
+	if (in->start.tv_sec || in->start.tv_nsec)
+		in->restarts++;
 	clock_gettime(CLOCK_MONOTONIC, &in->start);
 	uloop_process_add(&in->proc);
 
+	if (in->pressure.cgroup)
+		pressure_register(in);
+
+	instance_ident(in);
+
 	if (opipe[0] > -1) {
-		ustream_fd_init(&in->_stdout, opipe[0]);
+		logger_stream_open(&in->_stdout, opipe[0]);
 		closefd(opipe[1]);
 	}
 
 	if (epipe[0] > -1) {
-		ustream_fd_init(&in->_stderr, epipe[0]);
+		logger_stream_open(&in->_stderr, epipe[0]);
 		closefd(epipe[1]);
 	}
 
-	service_event("instance.start", in->srv->name, in->name);
-}
-
-static void
-instance_stdio(struct ustream *s, int prio, struct service_instance *in)
-{
-	char *newline, *str, *arg0, ident[32];
-	int len;
-
-	arg0 = basename(blobmsg_data(blobmsg_data(in->command)));
-	snprintf(ident, sizeof(ident), "%s[%d]", arg0, in->proc.pid);
-	ulog_open(ULOG_SYSLOG, LOG_DAEMON, ident);
-
-	do {
-		str = ustream_get_read_buf(s, NULL);
-		if (!str)
-			break;
-
-		newline = strchr(str, '\n');
-		if (!newline)
-			break;
-
-		*newline = 0;
-		ulog(prio, "%s\n", str);
-
-		len = newline + 1 - str;
-		ustream_consume(s, len);
-	} while (1);
-
-	ulog_open(ULOG_SYSLOG, LOG_DAEMON, "unitd");
-}
-
-static void
-instance_stdout(struct ustream *s, UNUSED int bytes)
-{
-	instance_stdio(s, LOG_INFO,
-	               container_of(s, struct service_instance, _stdout.stream));
-}
-
-static void
-instance_stderr(struct ustream *s, UNUSED int bytes)
-{
-	instance_stdio(s, LOG_ERR,
-	               container_of(s, struct service_instance, _stderr.stream));
+	instance_touch(in);
+	if (!in->batch_start)
+		service_event("instance.start", in->srv->name, in->name);
 }
 
 static void
@@ -343,8 +459,10 @@ instance_exit(struct uloop_process *p, int ret)
 	struct service_instance *in;
 	struct timespec tp;
 	long runtime;
+	bool batched;
 
 	in = container_of(p, struct service_instance, proc);
+	batched = in->batch_restart;
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	runtime = tp.tv_sec - in->start.tv_sec;
@@ -352,10 +470,12 @@ instance_exit(struct uloop_process *p, int ret)
 	DEBUG(2, "Instance %s::%s exit with error code %d after %ld seconds\n", in->srv->name, in->name, ret, runtime);
 
 	uloop_timeout_cancel(&in->timeout);
+	in->ready = false;
 	if (in->halt) {
 		/* no action */
 	} else if (in->restart) {
-		instance_start(in);
+		if (!batched)
+			instance_start(in);
 	} else if (in->respawn) {
 		if (runtime < in->respawn_threshold)
 			in->respawn_count++;
@@ -370,7 +490,13 @@ instance_exit(struct uloop_process *p, int ret)
 			uloop_timeout_set(&in->timeout, in->respawn_timeout * 1000);
 		}
 	}
-	service_event("instance.stop", in->srv->name, in->name);
+	instance_touch(in);
+
+	/* Restarts of a batch are started through its start queue */
+	if (batched)
+		service_restart_exited(in);
+	else
+		service_event("instance.stop", in->srv->name, in->name);
 }
 
 void
@@ -383,53 +509,271 @@ instance_stop(struct service_instance *in)
 	kill(in->proc.pid, SIGTERM);
 }
 
+static bool
+instance_can_reload(struct service_instance *in)
+{
+	return in->reload || in->reload_signal;
+}
+
 static void
+instance_reload_run(struct service_instance *in)
+{
+	struct blob_attr *cur;
+	char **argv, buf[16];
+	int argc = 1; /* NULL terminated */
+	int rem, fd;
+
+	blobmsg_for_each_attr(cur, in->reload, rem)
+		argc++;
+
+	argv = alloca(sizeof(char *) * argc);
+	argc = 0;
+
+	blobmsg_for_each_attr(cur, in->reload, rem)
+		argv[argc++] = blobmsg_data(cur);
+
+	argv[argc] = NULL;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd > -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		closefd(fd);
+	}
+
+	snprintf(buf, sizeof(buf), "%d", in->proc.pid);
+	setenv("MAINPID", buf, 1);
+
+	if (in->gid && setgid(in->gid))
+		exit(127);
+	if (in->uid && setuid(in->uid))
+		exit(127);
+
+	execvp(argv[0], argv);
+	exit(127);
+}
+
+static void
+instance_reload_exit(struct uloop_process *p, int ret)
+{
+	struct service_instance *in;
+
+	in = container_of(p, struct service_instance, reload_proc);
+	in->reloading = false;
+
+	if (ret)
+		LOG("Reloading instance %s::%s failed with error code %d\n", in->srv->name, in->name, ret);
+	else
+		DEBUG(2, "Reloaded instance %s::%s\n", in->srv->name, in->name);
+
+	instance_touch(in);
+	service_event("instance.reload", in->srv->name, in->name);
+
+	/* The configuration changed again while the reload command was running */
+	if (in->reload_pending) {
+		in->reload_pending = false;
+		instance_reload(in);
+	}
+}
+
+void
+instance_reload(struct service_instance *in)
+{
+	int pid;
+
+	if (!in->proc.pending)
+		return;
+
+	if (in->reloading) {
+		in->reload_pending = true;
+		return;
+	}
+
+	if (!in->reload) {
+		DEBUG(2, "Reloading instance %s::%s\n", in->srv->name, in->name);
+		kill(in->proc.pid, in->reload_signal ? in->reload_signal : SIGHUP);
+		service_event("instance.reload", in->srv->name, in->name);
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0)
+		return;
+
+	if (!pid) {
+		uloop_done();
+		instance_reload_run(in);
+		return;
+	}
+
+	DEBUG(2, "Reloading instance %s::%s\n", in->srv->name, in->name);
+	in->reloading = true;
+	in->reload_proc.pid = pid;
+	uloop_process_add(&in->reload_proc);
+	instance_touch(in);
+}
+
+int
+instance_fdstore_add(struct service_instance *in, int fd, const char *name)
+{
+	struct instance_fd *f;
+	char *name_buf;
+
+	if (in->n_fdstore >= in->fdstore_max)
+		return -1;
+
+	f = calloc_a(sizeof(*f), &name_buf, strlen(name) + 1);
+	if (!f)
+		return -1;
+
+	f->fd = fd;
+	f->name = strcpy(name_buf, name);
+	list_add_tail(&f->list, &in->fdstore);
+	in->n_fdstore++;
+	instance_touch(in);
+
+	return 0;
+}
+
+void
+instance_fdstore_remove(struct service_instance *in, const char *name)
+{
+	struct instance_fd *f, *tmp;
+
+	list_for_each_entry_safe(f, tmp, &in->fdstore, list) {
+		if (name && strcmp(f->name, name))
+			continue;
+
+		list_del(&f->list);
+		close(f->fd);
+		free(f);
+		in->n_fdstore--;
+		instance_touch(in);
+	}
+}
+
+void
 instance_restart(struct service_instance *in)
 {
 	if (!in->proc.pending)
 		return;
 	in->halt = false;
 	in->restart = true;
+	service_restart_deferred(in);
 	kill(in->proc.pid, SIGTERM);
 }
 
 static bool
-instance_config_changed(struct service_instance *in, struct service_instance *in_new)
+instance_pressure_changed(struct service_instance *in, struct service_instance *in_new)
 {
-	if (!in->valid)
+	if (in->pressure.action != in_new->pressure.action)
 		return true;
 
-	if (!blob_attr_equal(in->command, in_new->command))
+	if (!in->pressure.cgroup || !in_new->pressure.cgroup)
+		return in->pressure.cgroup != in_new->pressure.cgroup;
+
+	return strcmp(in->pressure.cgroup, in_new->pressure.cgroup) != 0;
+}
+
+static bool
+instance_log_file_changed(struct service_instance *in, struct service_instance *in_new)
+{
+	if (in->log_file.raw != in_new->log_file.raw)
 		return true;
 
+	if (!in->log_file.path || !in_new->log_file.path)
+		return in->log_file.path != in_new->log_file.path;
+
+	return strcmp(in->log_file.path, in_new->log_file.path) != 0;
+}
+
+static bool
+instance_respawn_changed(struct service_instance *in, struct service_instance *in_new)
+{
+	return in->respawn != in_new->respawn ||
+		in->respawn_threshold != in_new->respawn_threshold ||
+		in->respawn_timeout != in_new->respawn_timeout ||
+		in->respawn_retry != in_new->respawn_retry;
+}
+
+unsigned int
+instance_config_diff(struct service_instance *in, struct service_instance *in_new)
+{
+	unsigned int diff = 0;
+
+	if (!in->valid)
+		return INSTANCE_DIFF_ALL;
+
+	if (!blob_attr_equal(in->command, in_new->command))
+		diff |= 1U << INSTANCE_FIELD_COMMAND;
+
 	if (!blobmsg_list_equal(&in->env, &in_new->env))
-		return true;
+		diff |= 1U << INSTANCE_FIELD_ENV;
 
 	if (!blobmsg_list_equal(&in->data, &in_new->data))
-		return true;
+		diff |= 1U << INSTANCE_FIELD_DATA;
 
 	if (!blobmsg_list_equal(&in->netdev, &in_new->netdev))
-		return true;
+		diff |= 1U << INSTANCE_FIELD_NETDEV;
 
 	if (!blobmsg_list_equal(&in->file, &in_new->file))
-		return true;
+		diff |= 1U << INSTANCE_FIELD_FILE;
 
 	if (in->nice != in_new->nice)
-		return true;
-
-	if (in->uid != in_new->uid)
-		return true;
+		diff |= 1U << INSTANCE_FIELD_NICE;
 
-	if (in->gid != in_new->gid)
-		return true;
+	if (in->uid != in_new->uid || in->gid != in_new->gid)
+		diff |= 1U << INSTANCE_FIELD_USER;
 
 	if (!blobmsg_list_equal(&in->limits, &in_new->limits))
-		return true;
+		diff |= 1U << INSTANCE_FIELD_LIMITS;
 
 	if (!blobmsg_list_equal(&in->errors, &in_new->errors))
-		return true;
+		diff |= 1U << INSTANCE_FIELD_ERROR;
+
+	if (instance_respawn_changed(in, in_new))
+		diff |= 1U << INSTANCE_FIELD_RESPAWN;
+
+	if ((in->_stdout.fd.fd > -2) != (in_new->_stdout.fd.fd > -2) ||
+	    (in->_stderr.fd.fd > -2) != (in_new->_stderr.fd.fd > -2) ||
+	    instance_log_file_changed(in, in_new))
+		diff |= 1U << INSTANCE_FIELD_STDIO;
 
-	return false;
+	if (in->reload_signal != in_new->reload_signal ||
+	    !blob_attr_equal(in->reload, in_new->reload))
+		diff |= 1U << INSTANCE_FIELD_RELOAD;
+
+	if (instance_pressure_changed(in, in_new))
+		diff |= 1U << INSTANCE_FIELD_PRESSURE;
+
+	if (in->fdstore_max != in_new->fdstore_max)
+		diff |= 1U << INSTANCE_FIELD_FDSTORE;
+
+	if (in->log.rate != in_new->log.rate || in->log.burst != in_new->log.burst ||
+	    in->log_file.max_size != in_new->log_file.max_size ||
+	    in->log_file.rotate != in_new->log_file.rotate)
+		diff |= 1U << INSTANCE_FIELD_LOG;
+
+	return diff;
+}
+
+enum instance_action
+instance_diff_action(unsigned int diff, struct service_instance *in_new)
+{
+	enum instance_action action = INSTANCE_ACTION_NONE;
+	int i;
+
+	for (i = 0; i < __INSTANCE_FIELD_MAX; i++) {
+		if ((diff & (1U << i)) && instance_fields[i].action > action)
+			action = instance_fields[i].action;
+	}
+
+	/* Without a way to reload, the instance needs to be restarted */
+	if (action == INSTANCE_ACTION_RELOAD && !instance_can_reload(in_new))
+		action = INSTANCE_ACTION_RESTART;
+
+	return action;
 }
 
 static bool
@@ -446,7 +790,7 @@ instance_netdev_update(struct blobmsg_list_node *l)
 {
 	struct instance_netdev *n = container_of(l, struct instance_netdev, node);
 
-	n->ifindex = if_nametoindex(n->node.avl.key);
+	n->ifindex = if_nametoindex(n->node.key);
 }
 
 static bool
@@ -459,16 +803,15 @@ instance_file_cmp(struct blobmsg_list_node *l1, struct blobmsg_list_node *l2)
 }
 
 static void
-instance_file_update(struct blobmsg_list_node *l)
+instance_file_md5(const char *path, uint32_t *digest)
 {
-	struct instance_file *f = container_of(l, struct instance_file, node);
 	md5_ctx_t md5;
 	char buf[256];
 	int len, fd;
 
-	memset(f->md5, 0, sizeof(f->md5));
+	memset(digest, 0, 4 * sizeof(*digest));
 
-	fd = open(l->avl.key, O_RDONLY);
+	fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return;
 
@@ -487,21 +830,89 @@ instance_file_update(struct blobmsg_list_node *l)
 		md5_hash(buf, len, &md5);
 	} while(1);
 
-	md5_end(f->md5, &md5);
+	md5_end(digest, &md5);
 	close(fd);
 }
 
 static void
-instance_fill_any(struct blobmsg_list *l, struct blob_attr *cur)
+instance_file_update(struct blobmsg_list_node *l)
+{
+	struct instance_file *f = container_of(l, struct instance_file, node);
+
+	instance_file_md5(l->key, f->md5);
+}
+
+/*
+ * The digest covers the raw config blob and everything resolved from it
+ * while parsing that can change independently, i.e. file contents and
+ * interface indices. With resolve set, these are looked up again instead
+ * of taking the values stored in the instance.
+ */
+static void
+instance_digest(struct service_instance *in, struct blob_attr *config,
+		bool resolve, uint32_t *digest)
+{
+	struct blobmsg_list_node *node;
+	md5_ctx_t md5;
+
+	md5_begin(&md5);
+	md5_hash(config, blob_raw_len(config), &md5);
+
+	blobmsg_list_for_each(&in->file, node) {
+		struct instance_file *f = container_of(node, struct instance_file, node);
+		uint32_t file_md5[4];
+
+		if (resolve) {
+			instance_file_md5(node->key, file_md5);
+			md5_hash(file_md5, sizeof(file_md5), &md5);
+		} else {
+			md5_hash(f->md5, sizeof(f->md5), &md5);
+		}
+	}
+
+	blobmsg_list_for_each(&in->netdev, node) {
+		struct instance_netdev *n = container_of(node, struct instance_netdev, node);
+		int ifindex = resolve ? (int)if_nametoindex(node->key) : n->ifindex;
+
+		md5_hash(&ifindex, sizeof(ifindex), &md5);
+	}
+
+	md5_end(digest, &md5);
+}
+
+bool
+instance_config_unchanged(struct service_instance *in, struct blob_attr *config)
+{
+	uint32_t digest[4];
+
+	if (!in->valid)
+		return false;
+
+	instance_digest(in, config, true, digest);
+	return !memcmp(digest, in->digest, sizeof(digest));
+}
+
+static size_t
+instance_list_size(struct blobmsg_list *l, struct blob_attr *cur, bool array)
+{
+	if (!cur)
+		return 0;
+
+	return blobmsg_list_count(blobmsg_data(cur), blobmsg_data_len(cur), array) * l->node_len;
+}
+
+static void
+instance_fill_any(struct blobmsg_list *l, struct blob_attr *cur, char **buf)
 {
 	if (!cur)
 		return;
 
-	blobmsg_list_fill(l, blobmsg_data(cur), blobmsg_data_len(cur), false);
+	blobmsg_list_fill_buf(l, *buf, blobmsg_data(cur), blobmsg_data_len(cur), false);
+	*buf += instance_list_size(l, cur, false);
 }
 
 static bool
-instance_fill_array(struct blobmsg_list *l, struct blob_attr *cur, blobmsg_update_cb cb, bool array)
+instance_fill_array(struct blobmsg_list *l, struct blob_attr *cur, blobmsg_update_cb cb, bool array, char **buf)
 {
 	struct blobmsg_list_node *node;
 
@@ -511,7 +922,8 @@ instance_fill_array(struct blobmsg_list *l, struct blob_attr *cur, blobmsg_updat
 	if (!blobmsg_check_attr_list(cur, BLOBMSG_TYPE_STRING))
 		return false;
 
-	blobmsg_list_fill(l, blobmsg_data(cur), blobmsg_data_len(cur), array);
+	blobmsg_list_fill_buf(l, *buf, blobmsg_data(cur), blobmsg_data_len(cur), array);
+	*buf += instance_list_size(l, cur, array);
 	if (cb) {
 		blobmsg_list_for_each(l, node)
 			cb(node);
@@ -524,6 +936,8 @@ instance_config_parse(struct service_instance *in)
 {
 	struct blob_attr *tb[__INSTANCE_ATTR_MAX];
 	struct blob_attr *cur, *cur2;
+	size_t size;
+	char *buf;
 	int argc = 0;
 	int rem;
 
@@ -577,27 +991,118 @@ instance_config_parse(struct service_instance *in)
 		}
 	}
 
+	if ((cur = tb[INSTANCE_ATTR_RELOAD_SIGNAL])) {
+		in->reload_signal = blobmsg_get_u32(cur);
+		if (in->reload_signal <= 0 || in->reload_signal >= NSIG)
+			return false;
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_PRESSURE])) {
+		struct blob_attr *ptb[__PRESSURE_ATTR_MAX];
+		unsigned int i;
+
+		blobmsg_parse(pressure_attr, __PRESSURE_ATTR_MAX, ptb,
+			blobmsg_data(cur), blobmsg_data_len(cur));
+
+		if (!ptb[PRESSURE_ATTR_ACTION])
+			return false;
+
+		for (i = 0; i < ARRAY_SIZE(pressure_actions); i++) {
+			if (!strcmp(blobmsg_get_string(ptb[PRESSURE_ATTR_ACTION]), pressure_actions[i]))
+				in->pressure.action = i;
+		}
+		if (!in->pressure.action)
+			return false;
+
+		if (ptb[PRESSURE_ATTR_CGROUP])
+			in->pressure.cgroup = blobmsg_get_string(ptb[PRESSURE_ATTR_CGROUP]);
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_FDSTORE]))
+		in->fdstore_max = blobmsg_get_u32(cur);
+
+	if ((cur = tb[INSTANCE_ATTR_LOG_LIMIT])) {
+		struct blob_attr *ltb[__LOG_LIMIT_ATTR_MAX];
+
+		blobmsg_parse(log_limit_attr, __LOG_LIMIT_ATTR_MAX, ltb,
+			blobmsg_data(cur), blobmsg_data_len(cur));
+
+		if (ltb[LOG_LIMIT_ATTR_RATE])
+			in->log.rate = blobmsg_get_u32(ltb[LOG_LIMIT_ATTR_RATE]);
+		if (ltb[LOG_LIMIT_ATTR_BURST])
+			in->log.burst = blobmsg_get_u32(ltb[LOG_LIMIT_ATTR_BURST]);
+		if (in->log.rate && !in->log.burst)
+			return false;
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_LOG_FILE])) {
+		struct blob_attr *ftb[__LOG_FILE_ATTR_MAX];
+
+		blobmsg_parse(log_file_attr, __LOG_FILE_ATTR_MAX, ftb,
+			blobmsg_data(cur), blobmsg_data_len(cur));
+
+		if (!ftb[LOG_FILE_ATTR_PATH])
+			return false;
+
+		in->log_file.path = blobmsg_get_string(ftb[LOG_FILE_ATTR_PATH]);
+		if (ftb[LOG_FILE_ATTR_SIZE])
+			in->log_file.max_size = blobmsg_get_u32(ftb[LOG_FILE_ATTR_SIZE]);
+		if (ftb[LOG_FILE_ATTR_ROTATE])
+			in->log_file.rotate = blobmsg_get_u32(ftb[LOG_FILE_ATTR_ROTATE]);
+		if (ftb[LOG_FILE_ATTR_RAW])
+			in->log_file.raw = blobmsg_get_bool(ftb[LOG_FILE_ATTR_RAW]);
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_RELOAD])) {
+		if (!blobmsg_check_attr_list(cur, BLOBMSG_TYPE_STRING))
+			return false;
+
+		argc = 0;
+		blobmsg_for_each_attr(cur2, cur, rem) {
+			argc++;
+			break;
+		}
+		if (argc)
+			in->reload = cur;
+	}
+
 	if (tb[INSTANCE_ATTR_STDOUT] && blobmsg_get_bool(tb[INSTANCE_ATTR_STDOUT]))
 		in->_stdout.fd.fd = -1;
 
 	if (tb[INSTANCE_ATTR_STDERR] && blobmsg_get_bool(tb[INSTANCE_ATTR_STDERR]))
 		in->_stderr.fd.fd = -1;
 
-	instance_fill_any(&in->data, tb[INSTANCE_ATTR_DATA]);
+	/* All lists share a single allocation */
+	size = instance_list_size(&in->data, tb[INSTANCE_ATTR_DATA], false) +
+		instance_list_size(&in->env, tb[INSTANCE_ATTR_ENV], false) +
+		instance_list_size(&in->netdev, tb[INSTANCE_ATTR_NETDEV], true) +
+		instance_list_size(&in->file, tb[INSTANCE_ATTR_FILE], true) +
+		instance_list_size(&in->limits, tb[INSTANCE_ATTR_LIMITS], false) +
+		instance_list_size(&in->errors, tb[INSTANCE_ATTR_ERROR], true);
+
+	if (size) {
+		in->lists = calloc(1, size);
+		if (!in->lists)
+			return false;
+	}
+
+	buf = in->lists;
 
-	if (!instance_fill_array(&in->env, tb[INSTANCE_ATTR_ENV], NULL, false))
+	instance_fill_any(&in->data, tb[INSTANCE_ATTR_DATA], &buf);
+
+	if (!instance_fill_array(&in->env, tb[INSTANCE_ATTR_ENV], NULL, false, &buf))
 		return false;
 
-	if (!instance_fill_array(&in->netdev, tb[INSTANCE_ATTR_NETDEV], instance_netdev_update, true))
+	if (!instance_fill_array(&in->netdev, tb[INSTANCE_ATTR_NETDEV], instance_netdev_update, true, &buf))
 		return false;
 
-	if (!instance_fill_array(&in->file, tb[INSTANCE_ATTR_FILE], instance_file_update, true))
+	if (!instance_fill_array(&in->file, tb[INSTANCE_ATTR_FILE], instance_file_update, true, &buf))
 		return false;
 
-	if (!instance_fill_array(&in->limits, tb[INSTANCE_ATTR_LIMITS], NULL, false))
+	if (!instance_fill_array(&in->limits, tb[INSTANCE_ATTR_LIMITS], NULL, false, &buf))
 		return false;
 
-	if (!instance_fill_array(&in->errors, tb[INSTANCE_ATTR_ERROR], NULL, true))
+	if (!instance_fill_array(&in->errors, tb[INSTANCE_ATTR_ERROR], NULL, true, &buf))
 		return false;
 
 	return true;
@@ -612,6 +1117,8 @@ instance_config_cleanup(struct service_instance *in)
 	blobmsg_list_free(&in->file);
 	blobmsg_list_free(&in->limits);
 	blobmsg_list_free(&in->errors);
+	free(in->lists);
+	in->lists = NULL;
 }
 
 static void
@@ -624,7 +1131,32 @@ instance_config_move(struct service_instance *in, struct service_instance *in_sr
 	blobmsg_list_move(&in->file, &in_src->file);
 	blobmsg_list_move(&in->limits, &in_src->limits);
 	blobmsg_list_move(&in->errors, &in_src->errors);
+	in->lists = in_src->lists;
+	in_src->lists = NULL;
 	in->command = in_src->command;
+	memcpy(in->digest, in_src->digest, sizeof(in->digest));
+	in->nice = in_src->nice;
+	in->uid = in_src->uid;
+	in->gid = in_src->gid;
+	in->respawn = in_src->respawn;
+	in->respawn_threshold = in_src->respawn_threshold;
+	in->respawn_timeout = in_src->respawn_timeout;
+	in->respawn_retry = in_src->respawn_retry;
+	in->reload = in_src->reload;
+	in->reload_signal = in_src->reload_signal;
+	in->fdstore_max = in_src->fdstore_max;
+	in->log.rate = in_src->log.rate;
+	in->log.burst = in_src->log.burst;
+	if (in->log.tokens > in->log.burst)
+		in->log.tokens = in->log.burst;
+	logger_file_close(&in->log_file);
+	in->log_file.path = in_src->log_file.path;
+	in->log_file.max_size = in_src->log_file.max_size;
+	in->log_file.rotate = in_src->log_file.rotate;
+	in->log_file.raw = in_src->log_file.raw;
+	pressure_unregister(in);
+	in->pressure.action = in_src->pressure.action;
+	in->pressure.cgroup = in_src->pressure.cgroup;
 	in->name = in_src->name;
 	in->node.avl.key = in_src->node.avl.key;
 
@@ -636,21 +1168,41 @@ instance_config_move(struct service_instance *in, struct service_instance *in_sr
 bool
 instance_update(struct service_instance *in, struct service_instance *in_new)
 {
-	bool changed = instance_config_changed(in, in_new);
+	unsigned int diff = instance_config_diff(in, in_new);
 	bool running = in->proc.pending;
 
-	if (!changed && running)
+	if (!diff && running)
 		return false;
 
 	if (!running) {
-		if (changed)
+		if (diff)
 			instance_config_move(in, in_new);
 		instance_start(in);
-	} else {
+		return true;
+	}
+
+	switch (instance_diff_action(diff, in_new)) {
+	case INSTANCE_ACTION_RESTART:
 		instance_restart(in);
 		instance_config_move(in, in_new);
 		/* restart happens in the child callback handler */
+		break;
+
+	case INSTANCE_ACTION_RELOAD:
+		instance_config_move(in, in_new);
+		if (in->pressure.cgroup)
+			pressure_register(in);
+		instance_reload(in);
+		break;
+
+	case INSTANCE_ACTION_NONE:
+		instance_config_move(in, in_new);
+		in->halt = !in->respawn;
+		if (in->pressure.cgroup)
+			pressure_register(in);
+		break;
 	}
+
 	return true;
 }
 
@@ -658,7 +1210,15 @@ void
 instance_free(struct service_instance *in)
 {
 	instance_free_stdio(in);
+	logger_file_close(&in->log_file);
+	instance_fdstore_remove(in, NULL);
+	pressure_unregister(in);
+	list_del(&in->start_queue);
+	service_restart_cancel(in);
+	data_unindex(in);
+	status_remove(in);
 	uloop_process_delete(&in->proc);
+	uloop_process_delete(&in->reload_proc);
 	uloop_timeout_cancel(&in->timeout);
 	instance_config_cleanup(in);
 	free(in->config);
@@ -674,14 +1234,17 @@ instance_init(struct service_instance *in, struct service *s, struct blob_attr *
 	in->config = config;
 	in->timeout.cb = instance_timeout;
 	in->proc.cb = instance_exit;
-
-	in->_stdout.fd.fd = -2;
-	in->_stdout.stream.string_data = true;
-	in->_stdout.stream.notify_read = instance_stdout;
-
-	in->_stderr.fd.fd = -2;
-	in->_stderr.stream.string_data = true;
-	in->_stderr.stream.notify_read = instance_stderr;
+	in->reload_proc.cb = instance_reload_exit;
+	in->pressure.fd = -1;
+	INIT_LIST_HEAD(&in->fdstore);
+	INIT_LIST_HEAD(&in->start_queue);
+	INIT_LIST_HEAD(&in->data_refs);
+
+	logger_stream_init(&in->_stdout, in, STDOUT_FILENO, LOG_INFO);
+	logger_stream_init(&in->_stderr, in, STDERR_FILENO, LOG_ERR);
+	in->log.rate = LOG_RATE_DEFAULT;
+	in->log.burst = LOG_BURST_DEFAULT;
+	in->log_file.fd = -1;
 
 	blobmsg_list_init(&in->netdev, struct instance_netdev, node, instance_netdev_cmp);
 	blobmsg_list_init(&in->file, struct instance_file, node, instance_file_cmp);
@@ -690,9 +1253,11 @@ instance_init(struct service_instance *in, struct service *s, struct blob_attr *
 	blobmsg_list_simple_init(&in->limits);
 	blobmsg_list_simple_init(&in->errors);
 	in->valid = instance_config_parse(in);
+	in->log.tokens = in->log.burst;
+	instance_digest(in, config, false, in->digest);
 }
 
-void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int verbose)
+void instance_dump(struct blob_buf *b, struct service_instance *in, unsigned int fields)
 {
 	void *i;
 
@@ -700,12 +1265,19 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int v
 		return;
 
 	i = blobmsg_open_table(b, in->name);
-	blobmsg_add_u8(b, "running", in->proc.pending);
-	if (in->proc.pending)
+	if (fields & (1U << INSTANCE_DUMP_RUNNING)) {
+		blobmsg_add_u8(b, "running", in->proc.pending);
+		if (in->reloading)
+			blobmsg_add_u8(b, "reloading", true);
+		if (in->ready)
+			blobmsg_add_u8(b, "ready", true);
+	}
+	if ((fields & (1U << INSTANCE_DUMP_PID)) && in->proc.pending)
 		blobmsg_add_u32(b, "pid", in->proc.pid);
-	blobmsg_add_blob(b, in->command);
+	if (fields & (1U << INSTANCE_DUMP_COMMAND))
+		blobmsg_add_blob(b, in->command);
 
-	if (!avl_is_empty(&in->errors.avl)) {
+	if ((fields & (1U << INSTANCE_DUMP_ERRORS)) && !blobmsg_list_empty(&in->errors)) {
 		struct blobmsg_list_node *var;
 		void *e = blobmsg_open_array(b, "errors");
 		blobmsg_list_for_each(&in->errors, var)
@@ -713,7 +1285,8 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int v
 		blobmsg_close_table(b, e);
 	}
 
-	if (!avl_is_empty(&in->env.avl)) {
+	if ((fields & (1U << INSTANCE_DUMP_ENV)) &&
+	    !blobmsg_list_empty(&in->env)) {
 		struct blobmsg_list_node *var;
 		void *e = blobmsg_open_table(b, "env");
 		blobmsg_list_for_each(&in->env, var)
@@ -721,7 +1294,8 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int v
 		blobmsg_close_table(b, e);
 	}
 
-	if (!avl_is_empty(&in->data.avl)) {
+	if ((fields & (1U << INSTANCE_DUMP_DATA)) &&
+	    !blobmsg_list_empty(&in->data)) {
 		struct blobmsg_list_node *var;
 		void *e = blobmsg_open_table(b, "data");
 		blobmsg_list_for_each(&in->data, var)
@@ -729,7 +1303,8 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int v
 		blobmsg_close_table(b, e);
 	}
 
-	if (!avl_is_empty(&in->limits.avl)) {
+	if ((fields & (1U << INSTANCE_DUMP_LIMITS)) &&
+	    !blobmsg_list_empty(&in->limits)) {
 		struct blobmsg_list_node *var;
 		void *e = blobmsg_open_table(b, "limits");
 		blobmsg_list_for_each(&in->limits, var)
@@ -737,7 +1312,8 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int v
 		blobmsg_close_table(b, e);
 	}
 
-	if (in->respawn) {
+	if ((fields & (1U << INSTANCE_DUMP_RESPAWN)) &&
+	    in->respawn) {
 		void *r = blobmsg_open_table(b, "respawn");
 		blobmsg_add_u32(b, "threshold", in->respawn_threshold);
 		blobmsg_add_u32(b, "timeout", in->respawn_timeout);
@@ -745,5 +1321,68 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, UNUSED int v
 		blobmsg_close_table(b, r);
 	}
 
+	if ((fields & (1U << INSTANCE_DUMP_FDSTORE)) &&
+	    in->fdstore_max) {
+		void *f = blobmsg_open_table(b, "fdstore");
+		blobmsg_add_u32(b, "max", in->fdstore_max);
+		blobmsg_add_u32(b, "count", in->n_fdstore);
+		blobmsg_close_table(b, f);
+	}
+
+	if ((fields & (1U << INSTANCE_DUMP_PRESSURE)) &&
+	    in->pressure.action) {
+		void *p = blobmsg_open_table(b, "pressure");
+		blobmsg_add_string(b, "action", pressure_actions[in->pressure.action]);
+		if (in->pressure.cgroup)
+			blobmsg_add_string(b, "cgroup", in->pressure.cgroup);
+		blobmsg_add_u32(b, "events", in->pressure.events);
+		blobmsg_close_table(b, p);
+	}
+
+	if ((fields & (1U << INSTANCE_DUMP_LOG)) &&
+	    (in->_stdout.fd.fd > -2 || in->_stderr.fd.fd > -2)) {
+		void *l = blobmsg_open_table(b, "log");
+		blobmsg_add_u32(b, "rate", in->log.rate);
+		blobmsg_add_u32(b, "burst", in->log.burst);
+		blobmsg_add_u64(b, "lines", in->log.lines);
+		blobmsg_add_u64(b, "bytes", in->log.bytes);
+		blobmsg_add_u64(b, "dropped", in->log.dropped);
+		if (in->log_file.path) {
+			blobmsg_add_string(b, "file", in->log_file.path);
+			blobmsg_add_u8(b, "raw", in->log_file.raw);
+		}
+		blobmsg_close_table(b, l);
+	}
+
 	blobmsg_close_table(b, i);
 }
+
+unsigned int
+instance_dump_fields(struct blob_attr *attr)
+{
+	struct blob_attr *cur;
+	unsigned int fields = 0, i;
+	int rem;
+
+	blobmsg_for_each_attr(cur, attr, rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			continue;
+
+		for (i = 0; i < __INSTANCE_DUMP_MAX; i++) {
+			if (!strcmp(blobmsg_get_string(cur), instance_dump_names[i]))
+				fields |= 1U << i;
+		}
+	}
+
+	return fields;
+}
+
+void
+instance_touch(struct service_instance *in)
+{
+	in->generation = ++service_generation;
+	in->srv->generation = in->generation;
+	service_event_state(in);
+	status_update(in);
+	wait_update();
+}
@@ -18,10 +18,10 @@
 #pragma once
 
 #include "../utils.h"
+#include "logger.h"
 
 #include <libubox/vlist.h>
 #include <libubox/uloop.h>
-#include <libubox/ustream.h>
 
 #define RESPAWN_ERROR	(5 * 60)
 
@@ -36,10 +36,85 @@ struct jail {
 	int argc;
 };
 
+enum instance_pressure_action {
+	PRESSURE_ACTION_NONE = 0,
+	PRESSURE_ACTION_NOTIFY,
+	PRESSURE_ACTION_RELOAD,
+	PRESSURE_ACTION_STOP,
+};
+
+struct instance_pressure {
+	enum instance_pressure_action action;
+	const char *cgroup;
+	int fd;
+	unsigned int events;
+	struct timespec last;
+};
+
+struct instance_fd {
+	struct list_head list;
+	int fd;
+	const char *name;
+};
+
+enum instance_field {
+	INSTANCE_FIELD_COMMAND,
+	INSTANCE_FIELD_ENV,
+	INSTANCE_FIELD_DATA,
+	INSTANCE_FIELD_NETDEV,
+	INSTANCE_FIELD_FILE,
+	INSTANCE_FIELD_NICE,
+	INSTANCE_FIELD_USER,
+	INSTANCE_FIELD_LIMITS,
+	INSTANCE_FIELD_ERROR,
+	INSTANCE_FIELD_RESPAWN,
+	INSTANCE_FIELD_STDIO,
+	INSTANCE_FIELD_RELOAD,
+	INSTANCE_FIELD_PRESSURE,
+	INSTANCE_FIELD_FDSTORE,
+	INSTANCE_FIELD_LOG,
+	__INSTANCE_FIELD_MAX
+};
+
+#define INSTANCE_DIFF_ALL ((1U << __INSTANCE_FIELD_MAX) - 1)
+
+/* Ordered by increasing disruptiveness */
+enum instance_action {
+	INSTANCE_ACTION_NONE,
+	INSTANCE_ACTION_RELOAD,
+	INSTANCE_ACTION_RESTART,
+};
+
+struct instance_field_info {
+	const char *name;
+	enum instance_action action;
+};
+
+extern const struct instance_field_info instance_fields[__INSTANCE_FIELD_MAX];
+
+/* Fields of an instance included in service list replies */
+enum instance_dump_field {
+	INSTANCE_DUMP_RUNNING,
+	INSTANCE_DUMP_PID,
+	INSTANCE_DUMP_COMMAND,
+	INSTANCE_DUMP_ERRORS,
+	INSTANCE_DUMP_ENV,
+	INSTANCE_DUMP_DATA,
+	INSTANCE_DUMP_LIMITS,
+	INSTANCE_DUMP_RESPAWN,
+	INSTANCE_DUMP_FDSTORE,
+	INSTANCE_DUMP_PRESSURE,
+	INSTANCE_DUMP_LOG,
+	__INSTANCE_DUMP_MAX
+};
+
+#define INSTANCE_DUMP_ALL ((1U << __INSTANCE_DUMP_MAX) - 1)
+
 struct service_instance {
 	struct vlist_node node;
 	struct service *srv;
 	const char *name;
+	uint64_t generation;
 
 	int8_t nice;
 	bool valid;
@@ -49,6 +124,8 @@ struct service_instance {
 
 	bool halt;
 	bool restart;
+	bool ready;
+	uint32_t restarts;
 	bool respawn;
 	int respawn_count;
 	struct timespec start;
@@ -57,15 +134,41 @@ struct service_instance {
 	uint32_t respawn_threshold;
 	uint32_t respawn_retry;
 
+	struct blob_attr *reload;
+	int reload_signal;
+	bool reloading;
+	bool reload_pending;
+	struct uloop_process reload_proc;
+
+	struct instance_pressure pressure;
+
+	uint32_t fdstore_max;
+	uint32_t n_fdstore;
+	struct list_head fdstore;
+
+	/* Slot in the status table plus one, or 0 */
+	unsigned int status_slot;
+
+	/* Entry in the paced start queue of a batch apply */
+	struct list_head start_queue;
+	bool batch_start;		/* queued by a batch, no start event */
+	bool batch_restart;		/* restarted by a batch and not exited yet */
+
 	struct blob_attr *config;
+	uint32_t digest[4];
 	struct uloop_process proc;
 	struct uloop_timeout timeout;
-	struct ustream_fd _stdout;
-	struct ustream_fd _stderr;
+	struct log_stream _stdout;
+	struct log_stream _stderr;
+	struct log_limit log;
+	struct log_file log_file;
+	char ident[32];
 
 	struct blob_attr *command;
+	void *lists;
 	struct blobmsg_list env;
 	struct blobmsg_list data;
+	struct list_head data_refs;
 	struct blobmsg_list netdev;
 	struct blobmsg_list file;
 	struct blobmsg_list limits;
@@ -74,7 +177,16 @@ struct service_instance {
 
 void instance_start(struct service_instance *in);
 void instance_stop(struct service_instance *in);
+void instance_restart(struct service_instance *in);
+void instance_reload(struct service_instance *in);
 bool instance_update(struct service_instance *in, struct service_instance *in_new);
+unsigned int instance_config_diff(struct service_instance *in, struct service_instance *in_new);
+enum instance_action instance_diff_action(unsigned int diff, struct service_instance *in_new);
+bool instance_config_unchanged(struct service_instance *in, struct blob_attr *config);
 void instance_init(struct service_instance *in, struct service *s, struct blob_attr *config);
 void instance_free(struct service_instance *in);
-void instance_dump(struct blob_buf *b, struct service_instance *in, int debug);
+int instance_fdstore_add(struct service_instance *in, int fd, const char *name);
+void instance_fdstore_remove(struct service_instance *in, const char *name);
+void instance_dump(struct blob_buf *b, struct service_instance *in, unsigned int fields);
+unsigned int instance_dump_fields(struct blob_attr *attr);
+void instance_touch(struct service_instance *in);
@@ -0,0 +1,658 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libubox/avl-cmp.h>
+#include <libubox/ustream.h>
+
+#include "../unitd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "journal.h"
+#include "archive.h"
+
+/*
+ * The journal keeps the most recent output of all instances in a ring
+ * buffer, so the log of a single service can be retrieved without going
+ * through the system log.
+ *
+ * Records are stored back to back and never wrap; a record with length 0
+ * marks the end of the used space before the write position returns to
+ * the start of the buffer. Every record carries a sequence number, which
+ * is used as the cursor for queries. The offset of each live record is
+ * kept in an index addressed by its sequence number, and records of the
+ * same service are chained through the sequence number of their
+ * predecessor, so the last lines of a service can be found without
+ * scanning the whole ring.
+ */
+
+#define JOURNAL_SIZE		(512 * 1024)
+#define JOURNAL_ALIGN(len)	(((len) + 7) & ~7)
+
+/* Maximum amount of record data returned by a single read */
+#define JOURNAL_READ_MAX	(128 * 1024)
+
+/* Interval for writing the journal to the archive, if enabled */
+#define JOURNAL_FLUSH_INTERVAL	(5 * 60 * 1000)
+
+/* Followers that fall further behind than this are disconnected */
+#define JOURNAL_FOLLOW_MAX	(64 * 1024)
+
+#define JOURNAL_INDEX_SIZE	(JOURNAL_SIZE / sizeof(struct journal_record))
+
+struct journal_service {
+	struct avl_node avl;
+	uint64_t last;
+	uint32_t records;
+};
+
+struct journal_filter {
+	const char *service;
+	const char *instance;
+	int prio;
+};
+
+struct journal_follower {
+	struct list_head list;
+	struct ustream_fd s;
+	struct journal_filter filter;
+};
+
+static char *ring;
+static uint32_t *ring_index;
+static size_t head, tail;
+static uint64_t first_seq = 1, next_seq = 1;
+
+static bool persistent;
+static uint64_t flushed_seq = 1;
+static size_t unflushed;
+static struct uloop_timeout flush_timer;
+
+static struct avl_tree journal_services;
+static LIST_HEAD(followers);
+static struct blob_buf b;
+
+static inline struct journal_record *
+journal_at(size_t offset)
+{
+	return (struct journal_record *) (ring + offset);
+}
+
+static struct journal_record *
+journal_get(uint64_t seq)
+{
+	if (seq < first_seq || seq >= next_seq)
+		return NULL;
+
+	return journal_at(ring_index[seq % JOURNAL_INDEX_SIZE]);
+}
+
+static inline const char *
+journal_service_name(struct journal_record *r)
+{
+	return r->data;
+}
+
+static inline const char *
+journal_instance_name(struct journal_record *r)
+{
+	return r->data + r->service_len + 1;
+}
+
+static inline const char *
+journal_msg(struct journal_record *r)
+{
+	return r->data + r->service_len + r->instance_len + 2;
+}
+
+static void
+journal_evict(void)
+{
+	struct journal_record *r = journal_at(head);
+	struct journal_service *js;
+
+	js = avl_find_element(&journal_services, journal_service_name(r), js, avl);
+	if (js && !--js->records) {
+		avl_delete(&journal_services, &js->avl);
+		free(js);
+	}
+
+	first_seq++;
+	if (first_seq == next_seq) {
+		head = tail;
+		return;
+	}
+
+	head += r->len;
+	if (head == JOURNAL_SIZE || !journal_at(head)->len)
+		head = 0;
+}
+
+static struct journal_record *
+journal_reserve(size_t len)
+{
+	if (tail + len > JOURNAL_SIZE) {
+		while (first_seq != next_seq && head >= tail)
+			journal_evict();
+
+		if (tail < JOURNAL_SIZE)
+			journal_at(tail)->len = 0;
+
+		tail = 0;
+		if (first_seq == next_seq)
+			head = 0;
+	}
+
+	while (first_seq != next_seq && head >= tail && head < tail + len)
+		journal_evict();
+
+	return journal_at(tail);
+}
+
+static struct journal_service *
+journal_service_get(const char *name)
+{
+	struct journal_service *js;
+	char *new_name;
+
+	js = avl_find_element(&journal_services, name, js, avl);
+	if (js)
+		return js;
+
+	js = calloc_a(sizeof(*js), &new_name, strlen(name) + 1);
+	if (!js)
+		return NULL;
+
+	js->avl.key = strcpy(new_name, name);
+	avl_insert(&journal_services, &js->avl);
+
+	return js;
+}
+
+static bool
+journal_match(struct journal_filter *f, struct journal_record *r)
+{
+	if (r->prio > f->prio)
+		return false;
+
+	if (f->service && strcmp(f->service, journal_service_name(r)))
+		return false;
+
+	if (f->instance && strcmp(f->instance, journal_instance_name(r)))
+		return false;
+
+	return true;
+}
+
+static void
+journal_put(struct blob_buf *buf, struct journal_record *r)
+{
+	blobmsg_add_u64(buf, "cursor", r->seq);
+	blobmsg_add_u64(buf, "time", r->time);
+	blobmsg_add_string(buf, "service", journal_service_name(r));
+	blobmsg_add_string(buf, "instance", journal_instance_name(r));
+	blobmsg_add_u32(buf, "pid", r->pid);
+	blobmsg_add_string(buf, "stream", r->stream == STDERR_FILENO ? "stderr" : "stdout");
+	blobmsg_add_u32(buf, "priority", r->prio);
+	blobmsg_add_string(buf, "message", journal_msg(r));
+}
+
+static void
+journal_follower_free(struct journal_follower *f)
+{
+	list_del(&f->list);
+	ustream_free(&f->s.stream);
+	close(f->s.fd.fd);
+	free(f);
+}
+
+static void
+journal_follower_state(struct ustream *s)
+{
+	struct journal_follower *f = container_of(s, struct journal_follower, s.stream);
+
+	if (s->write_error || s->eof)
+		journal_follower_free(f);
+}
+
+static void
+journal_follower_write(struct journal_follower *f, struct journal_record *r)
+{
+	blob_buf_init(&b, 0);
+	journal_put(&b, r);
+	ustream_write(&f->s.stream, (char *) b.head, blob_pad_len(b.head), false);
+}
+
+static void
+journal_follow(struct journal_record *r)
+{
+	struct journal_follower *f, *tmp;
+
+	list_for_each_entry_safe(f, tmp, &followers, list) {
+		if (!journal_match(&f->filter, r))
+			continue;
+
+		if (f->s.stream.w.data_bytes > JOURNAL_FOLLOW_MAX) {
+			journal_follower_free(f);
+			continue;
+		}
+
+		journal_follower_write(f, r);
+	}
+}
+
+void
+journal_add(struct service_instance *in, int stream, int prio,
+	    const char *msg, size_t len)
+{
+	size_t service_len = strlen(in->srv->name);
+	size_t instance_len = strlen(in->name);
+	struct journal_service *js;
+	struct journal_record *r;
+	struct timespec now;
+	char *p;
+
+	if (!ring)
+		return;
+
+	r = journal_reserve(JOURNAL_ALIGN(sizeof(*r) + service_len + instance_len + len + 3));
+
+	/* Looked up after reserving, eviction may free the entry */
+	js = journal_service_get(in->srv->name);
+	if (!js)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	r->len = JOURNAL_ALIGN(sizeof(*r) + service_len + instance_len + len + 3);
+	r->pid = in->proc.pid;
+	r->seq = next_seq++;
+	r->prev = js->last;
+	r->time = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	r->stream = stream;
+	r->prio = prio;
+	r->service_len = service_len;
+	r->instance_len = instance_len;
+	r->msg_len = len;
+
+	p = r->data;
+	memcpy(p, in->srv->name, service_len + 1);
+	p += service_len + 1;
+	memcpy(p, in->name, instance_len + 1);
+	p += instance_len + 1;
+	memcpy(p, msg, len);
+	p[len] = 0;
+
+	ring_index[r->seq % JOURNAL_INDEX_SIZE] = tail;
+	tail += r->len;
+
+	js->last = r->seq;
+	js->records++;
+
+	/* Flush early instead of losing records to the ring wrapping around */
+	unflushed += r->len;
+	if (persistent && unflushed > JOURNAL_SIZE / 2 && unflushed - r->len <= JOURNAL_SIZE / 2)
+		uloop_timeout_set(&flush_timer, 0);
+
+	if (!list_empty(&followers))
+		journal_follow(r);
+}
+
+enum {
+	JOURNAL_READ_SERVICE,
+	JOURNAL_READ_INSTANCE,
+	JOURNAL_READ_PRIORITY,
+	JOURNAL_READ_CURSOR,
+	JOURNAL_READ_LINES,
+	JOURNAL_READ_FOLLOW,
+	JOURNAL_READ_BOOT,
+	__JOURNAL_READ_MAX
+};
+
+static const struct blobmsg_policy journal_read_attrs[__JOURNAL_READ_MAX] = {
+	[JOURNAL_READ_SERVICE] = { "service", BLOBMSG_TYPE_STRING },
+	[JOURNAL_READ_INSTANCE] = { "instance", BLOBMSG_TYPE_STRING },
+	[JOURNAL_READ_PRIORITY] = { "priority", BLOBMSG_TYPE_INT32 },
+	[JOURNAL_READ_CURSOR] = { "cursor", BLOBMSG_TYPE_INT64 },
+	[JOURNAL_READ_LINES] = { "lines", BLOBMSG_TYPE_INT32 },
+	[JOURNAL_READ_FOLLOW] = { "follow", BLOBMSG_TYPE_BOOL },
+	[JOURNAL_READ_BOOT] = { "boot", BLOBMSG_TYPE_INT32 },
+};
+
+struct journal_archive_read {
+	struct journal_filter *filter;
+	uint64_t start;
+	size_t max;
+
+	struct list_head records;
+	size_t n, size;
+};
+
+struct journal_copy {
+	struct list_head list;
+	char data[];
+};
+
+static void
+journal_archive_drop(struct journal_archive_read *ar)
+{
+	struct journal_copy *c = list_first_entry(&ar->records, struct journal_copy, list);
+
+	ar->n--;
+	ar->size -= ((struct journal_record *) c->data)->len;
+	list_del(&c->list);
+	free(c);
+}
+
+static void
+journal_archive_cb(struct journal_record *r, void *priv)
+{
+	struct journal_archive_read *ar = priv;
+	struct journal_copy *c;
+
+	if (r->seq < ar->start || !journal_match(ar->filter, r))
+		return;
+
+	c = malloc(sizeof(*c) + r->len);
+	if (!c)
+		return;
+
+	memcpy(c->data, r, r->len);
+	list_add_tail(&c->list, &ar->records);
+	ar->n++;
+	ar->size += r->len;
+
+	while (ar->n > ar->max || ar->size > JOURNAL_READ_MAX)
+		journal_archive_drop(ar);
+}
+
+/* Only the newest matching records that fit into a reply are returned */
+static int
+journal_read_archive(struct ubus_context *ctx, struct ubus_request_data *req,
+		     struct journal_filter *filter, uint64_t start, size_t max, int boot)
+{
+	struct journal_archive_read ar = {
+		.filter = filter,
+		.start = start,
+		.max = max,
+		.records = LIST_HEAD_INIT(ar.records),
+	};
+	struct journal_copy *c;
+	uint64_t cursor = start;
+	void *a;
+
+	if (!archive_read(boot, journal_archive_cb, &ar))
+		return UBUS_STATUS_NOT_FOUND;
+
+	blob_buf_init(&b, 0);
+	a = blobmsg_open_array(&b, "records");
+	list_for_each_entry(c, &ar.records, list) {
+		struct journal_record *r = (struct journal_record *) c->data;
+		void *e = blobmsg_open_table(&b, NULL);
+
+		journal_put(&b, r);
+		blobmsg_close_table(&b, e);
+		cursor = r->seq + 1;
+	}
+	blobmsg_close_array(&b, a);
+	blobmsg_add_u64(&b, "cursor", cursor);
+
+	while (ar.n)
+		journal_archive_drop(&ar);
+
+	ubus_send_reply(ctx, req, b.head);
+	return 0;
+}
+
+static struct journal_follower *
+journal_follower_new(struct ubus_context *ctx, struct ubus_request_data *req,
+		     struct journal_filter *filter)
+{
+	struct journal_follower *f;
+	char *service = NULL, *instance = NULL;
+	int fds[2];
+
+	f = calloc_a(sizeof(*f),
+		     &service, filter->service ? strlen(filter->service) + 1 : 0,
+		     &instance, filter->instance ? strlen(filter->instance) + 1 : 0);
+	if (!f)
+		return NULL;
+
+	if (pipe2(fds, O_CLOEXEC)) {
+		free(f);
+		return NULL;
+	}
+
+	f->filter.prio = filter->prio;
+	if (filter->service)
+		f->filter.service = strcpy(service, filter->service);
+	if (filter->instance)
+		f->filter.instance = strcpy(instance, filter->instance);
+
+	f->s.stream.notify_state = journal_follower_state;
+	ustream_fd_init(&f->s, fds[1]);
+	list_add(&f->list, &followers);
+
+	ubus_request_set_fd(ctx, req, fds[0]);
+
+	return f;
+}
+
+static int
+journal_handle_read(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+		    struct ubus_request_data *req, UNUSED const char *method,
+		    struct blob_attr *msg)
+{
+	struct blob_attr *tb[__JOURNAL_READ_MAX];
+	struct journal_filter filter = { .prio = LOG_DEBUG };
+	struct journal_service *js = NULL;
+	struct journal_follower *f = NULL;
+	struct journal_record *r;
+	uint64_t start = first_seq, seq, *seqs;
+	size_t n = 0, max = next_seq - first_seq, size = 0;
+	void *c;
+
+	blobmsg_parse(journal_read_attrs, __JOURNAL_READ_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (tb[JOURNAL_READ_SERVICE])
+		filter.service = blobmsg_data(tb[JOURNAL_READ_SERVICE]);
+	if (tb[JOURNAL_READ_INSTANCE])
+		filter.instance = blobmsg_data(tb[JOURNAL_READ_INSTANCE]);
+	if (tb[JOURNAL_READ_PRIORITY])
+		filter.prio = blobmsg_get_u32(tb[JOURNAL_READ_PRIORITY]);
+	if (tb[JOURNAL_READ_CURSOR] && blobmsg_get_u64(tb[JOURNAL_READ_CURSOR]) > start)
+		start = blobmsg_get_u64(tb[JOURNAL_READ_CURSOR]);
+	if (tb[JOURNAL_READ_LINES] && blobmsg_get_u32(tb[JOURNAL_READ_LINES]) < max)
+		max = blobmsg_get_u32(tb[JOURNAL_READ_LINES]);
+
+	if (tb[JOURNAL_READ_BOOT] && blobmsg_get_u32(tb[JOURNAL_READ_BOOT])) {
+		if (tb[JOURNAL_READ_FOLLOW])
+			return UBUS_STATUS_INVALID_ARGUMENT;
+
+		return journal_read_archive(ctx, req, &filter,
+			tb[JOURNAL_READ_CURSOR] ? blobmsg_get_u64(tb[JOURNAL_READ_CURSOR]) : 0,
+			tb[JOURNAL_READ_LINES] ? blobmsg_get_u32(tb[JOURNAL_READ_LINES]) : SIZE_MAX,
+			(int32_t) blobmsg_get_u32(tb[JOURNAL_READ_BOOT]));
+	}
+
+	if (filter.service) {
+		js = avl_find_element(&journal_services, filter.service, js, avl);
+		if (js && js->records < max)
+			max = js->records;
+	}
+
+	seqs = calloc(max ? max : 1, sizeof(*seqs));
+	if (!seqs)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	/*
+	 * Walk backwards from the newest record, so only the requested number
+	 * of lines needs to be looked at; with a service filter, only the
+	 * records of that service are visited.
+	 */
+	seq = filter.service ? (js ? js->last : 0) : next_seq - 1;
+	while (n < max && seq >= start && (r = journal_get(seq))) {
+		if (journal_match(&filter, r))
+			seqs[n++] = seq;
+
+		seq = filter.service ? r->prev : seq - 1;
+	}
+
+	if (tb[JOURNAL_READ_FOLLOW] && blobmsg_get_bool(tb[JOURNAL_READ_FOLLOW])) {
+		f = journal_follower_new(ctx, req, &filter);
+		if (!f) {
+			free(seqs);
+			return UBUS_STATUS_UNKNOWN_ERROR;
+		}
+	}
+
+	blob_buf_init(&b, 0);
+	c = blobmsg_open_array(&b, "records");
+	while (n && size < JOURNAL_READ_MAX) {
+		void *e;
+
+		r = journal_get(seqs[--n]);
+		size += r->len;
+
+		e = blobmsg_open_table(&b, NULL);
+		journal_put(&b, r);
+		blobmsg_close_table(&b, e);
+	}
+	blobmsg_close_array(&b, c);
+
+	/*
+	 * Records that did not fit into the reply can be fetched with the
+	 * returned cursor; followers get them through their stream.
+	 */
+	blobmsg_add_u64(&b, "cursor", n && !f ? seqs[n - 1] : next_seq);
+	ubus_send_reply(ctx, req, b.head);
+
+	while (f && n)
+		journal_follower_write(f, journal_get(seqs[--n]));
+
+	free(seqs);
+	return 0;
+}
+
+static struct ubus_method journal_object_methods[] = {
+	UBUS_METHOD("read", journal_handle_read, journal_read_attrs),
+};
+
+static struct ubus_object_type journal_object_type =
+	UBUS_OBJECT_TYPE("log", journal_object_methods);
+
+static struct ubus_object journal_object = {
+	.name = "log",
+	.type = &journal_object_type,
+	.methods = journal_object_methods,
+	.n_methods = ARRAY_SIZE(journal_object_methods),
+};
+
+void
+journal_flush(void)
+{
+	static char block[ARCHIVE_BLOCK_SIZE];
+	struct journal_record *r;
+	size_t len = 0;
+	uint64_t seq;
+
+	if (!persistent)
+		return;
+
+	if (flushed_seq < first_seq) {
+		DEBUG(2, "%llu journal records were lost before being archived\n",
+		      (unsigned long long) (first_seq - flushed_seq));
+		flushed_seq = first_seq;
+	}
+
+	for (seq = flushed_seq; seq < next_seq; seq++) {
+		r = journal_get(seq);
+		if (len + r->len > sizeof(block)) {
+			archive_append(block, len);
+			len = 0;
+		}
+
+		memcpy(block + len, r, r->len);
+		len += r->len;
+	}
+
+	archive_append(block, len);
+	archive_sync();
+
+	flushed_seq = next_seq;
+	unflushed = 0;
+	uloop_timeout_set(&flush_timer, JOURNAL_FLUSH_INTERVAL);
+}
+
+static void
+journal_flush_cb(UNUSED struct uloop_timeout *t)
+{
+	journal_flush();
+}
+
+void
+journal_ubus_init(struct ubus_context *ctx)
+{
+	ubus_add_object(ctx, &journal_object);
+}
+
+void
+journal_init(void)
+{
+	int fd;
+
+	avl_init(&journal_services, avl_strcmp, false, NULL);
+
+	/* Backed by a memfd, so the ring shows up as a named mapping */
+	fd = memfd_create("unitd-journal", MFD_CLOEXEC);
+	if (fd < 0) {
+		ERROR("Failed to create journal: %s\n", strerror(errno));
+		return;
+	}
+
+	if (ftruncate(fd, JOURNAL_SIZE)) {
+		ERROR("Failed to create journal: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	ring_index = calloc(JOURNAL_INDEX_SIZE, sizeof(*ring_index));
+	if (!ring_index) {
+		close(fd);
+		return;
+	}
+
+	ring = mmap(NULL, JOURNAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ring == MAP_FAILED) {
+		ERROR("Failed to map journal: %s\n", strerror(errno));
+		free(ring_index);
+		ring_index = NULL;
+		ring = NULL;
+		return;
+	}
+
+	persistent = archive_init();
+	if (persistent) {
+		flush_timer.cb = journal_flush_cb;
+		uloop_timeout_set(&flush_timer, JOURNAL_FLUSH_INTERVAL);
+	}
+}
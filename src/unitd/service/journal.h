@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <libubus.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct service_instance;
+
+/*
+ * A journal record, followed by the NUL-terminated service name, instance
+ * name and message. len includes the header and is a multiple of 8.
+ */
+struct journal_record {
+	uint32_t len;
+	uint32_t pid;
+	uint64_t seq;
+	uint64_t prev;
+	uint64_t time;
+	uint8_t stream;
+	uint8_t prio;
+	uint16_t service_len;
+	uint16_t instance_len;
+	uint16_t msg_len;
+	char data[];
+};
+
+void journal_init(void);
+void journal_flush(void);
+void journal_ubus_init(struct ubus_context *ctx);
+void journal_add(struct service_instance *in, int stream, int prio,
+		 const char *msg, size_t len);
@@ -0,0 +1,758 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef UNITD_LOG_THREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#include "../unitd.h"
+
+#include "instance.h"
+#include "logger.h"
+#include "journal.h"
+#include "uring.h"
+
+#define LOG_SOCKET	"/dev/log"
+
+/* Maximum number of records sent with a single sendmmsg() */
+#define LOG_BATCH	32
+
+/* Maximum number of reads from a single stream per loop iteration */
+#define LOG_READS_MAX	4
+
+/* Maximum number of bytes spliced into a log file at once */
+#define LOG_SPLICE_MAX	(64 * 1024)
+
+/* "<pri>Mmm dd hh:mm:ss ident: " */
+#define LOG_HDR_MAX	(8 + 16 + sizeof(((struct service_instance *)0)->ident) + 2)
+
+/*
+ * Read buffer of a stream. With io_uring, a read may still be in flight
+ * when the stream is closed; the buffer is then orphaned and freed once
+ * the read completes.
+ */
+struct log_read {
+	struct uring_req req;
+	struct log_stream *ls;
+	bool pending;
+	char buf[LOG_LINE_MAX];
+};
+
+static int log_fd = -1;
+
+/* Streams with completed io_uring reads, to be resubmitted after flushing */
+static LIST_HEAD(pending_streams);
+
+static struct {
+	unsigned int n;
+	struct mmsghdr msgs[LOG_BATCH];
+	struct iovec iov[LOG_BATCH][2];
+	char hdr[LOG_BATCH][LOG_HDR_MAX];
+
+	time_t stamp_time;
+	char stamp[16];
+} batch;
+
+static bool
+logger_connect(void)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+		.sun_path = LOG_SOCKET,
+	};
+
+	if (log_fd >= 0)
+		return true;
+
+	log_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (log_fd < 0)
+		return false;
+
+	if (connect(log_fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(log_fd);
+		log_fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/* Like syslog(), records are dropped when no syslog daemon is listening */
+static void
+logger_send(struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	int ret;
+
+	while (n) {
+		if (!logger_connect())
+			return;
+
+		ret = sendmmsg(log_fd, msgs, n, flags);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN) {
+				close(log_fd);
+				log_fd = -1;
+			}
+
+			return;
+		}
+
+		msgs += ret;
+		n -= ret;
+	}
+}
+
+#ifdef UNITD_LOG_THREAD
+
+/*
+ * The log thread owns the syslog socket and does all blocking I/O.
+ * Records are passed through a ring of fixed-size slots. The main thread
+ * never waits for the log thread; when the ring is full, records are
+ * dropped.
+ */
+
+#define LOG_RING_SIZE 128
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int head, tail;
+	size_t len[LOG_RING_SIZE];
+	char data[LOG_RING_SIZE][LOG_HDR_MAX + LOG_LINE_MAX];
+} ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+logger_thread(UNUSED void *arg)
+{
+	struct mmsghdr msgs[LOG_BATCH] = {};
+	struct iovec iov[LOG_BATCH];
+	unsigned int i, n, tail;
+
+	while (true) {
+		pthread_mutex_lock(&ring.lock);
+		while (ring.head == ring.tail)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+
+		tail = ring.tail;
+		n = ring.head - tail;
+		pthread_mutex_unlock(&ring.lock);
+
+		if (n > LOG_BATCH)
+			n = LOG_BATCH;
+
+		/* Slots between tail and head are not touched by the main thread */
+		for (i = 0; i < n; i++) {
+			unsigned int slot = (tail + i) % LOG_RING_SIZE;
+
+			iov[i].iov_base = ring.data[slot];
+			iov[i].iov_len = ring.len[slot];
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		logger_send(msgs, n, 0);
+
+		pthread_mutex_lock(&ring.lock);
+		ring.tail += n;
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	return NULL;
+}
+
+static void
+logger_flush(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&ring.lock);
+	for (i = 0; i < batch.n; i++) {
+		struct iovec *iov = batch.iov[i];
+		unsigned int slot = ring.head % LOG_RING_SIZE;
+
+		if (ring.head - ring.tail == LOG_RING_SIZE)
+			break;
+
+		memcpy(ring.data[slot], iov[0].iov_base, iov[0].iov_len);
+		memcpy(ring.data[slot] + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+		ring.len[slot] = iov[0].iov_len + iov[1].iov_len;
+		ring.head++;
+	}
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+
+	batch.n = 0;
+}
+
+#else
+
+static void
+logger_flush(void)
+{
+	if (!batch.n)
+		return;
+
+	/* Never block the main loop on a slow syslog daemon */
+	logger_send(batch.msgs, batch.n, MSG_DONTWAIT);
+	batch.n = 0;
+}
+
+#endif
+
+static const char *
+logger_timestamp(void)
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (now != batch.stamp_time) {
+		batch.stamp_time = now;
+		localtime_r(&now, &tm);
+		strftime(batch.stamp, sizeof(batch.stamp), "%h %e %T", &tm);
+	}
+
+	return batch.stamp;
+}
+
+static void
+logger_file_rotate(struct log_file *lf);
+
+/*
+ * Returns the fd of the log file, which always has room for at least one
+ * byte below max_size, or -1 if the file is unavailable
+ */
+static int
+logger_file_get(struct log_file *lf)
+{
+	off_t size;
+
+	if (lf->failed)
+		return -1;
+
+	if (lf->fd < 0) {
+		/* Not O_APPEND, splice() does not support it */
+		lf->fd = open(lf->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0640);
+		if (lf->fd < 0) {
+			ERROR("Failed to open log file %s: %s\n", lf->path, strerror(errno));
+			lf->failed = true;
+			return -1;
+		}
+
+		size = lseek(lf->fd, 0, SEEK_END);
+		lf->size = size > 0 ? size : 0;
+	}
+
+	/* The limit may have been lowered, or an earlier rotation failed */
+	if (lf->max_size && lf->size >= lf->max_size) {
+		logger_file_rotate(lf);
+		if (lf->fd < 0 || lf->size >= lf->max_size)
+			return -1;
+	}
+
+	return lf->fd;
+}
+
+void
+logger_file_close(struct log_file *lf)
+{
+	if (lf->fd >= 0)
+		close(lf->fd);
+
+	lf->fd = -1;
+	lf->failed = false;
+}
+
+static void
+logger_file_rotate(struct log_file *lf)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	uint32_t i;
+
+	if (!lf->rotate) {
+		if (!ftruncate(lf->fd, 0))
+			lf->size = 0;
+		lseek(lf->fd, 0, SEEK_SET);
+		return;
+	}
+
+	for (i = lf->rotate; i > 1; i--) {
+		snprintf(from, sizeof(from), "%s.%u", lf->path, i - 1);
+		snprintf(to, sizeof(to), "%s.%u", lf->path, i);
+		rename(from, to);
+	}
+
+	snprintf(to, sizeof(to), "%s.1", lf->path);
+	rename(lf->path, to);
+
+	logger_file_close(lf);
+	lf->fd = open(lf->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	lf->failed = lf->fd < 0;
+	lf->size = 0;
+}
+
+static void
+logger_file_written(struct log_file *lf, size_t len)
+{
+	lf->size += len;
+	if (lf->max_size && lf->size >= lf->max_size)
+		logger_file_rotate(lf);
+}
+
+static bool
+logger_file_line(struct log_stream *ls, const char *line, size_t len)
+{
+	struct log_file *lf = &ls->in->log_file;
+	char hdr[LOG_HDR_MAX];
+	struct iovec iov[3];
+	ssize_t ret;
+	int fd;
+
+	fd = logger_file_get(lf);
+	if (fd < 0)
+		return false;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = snprintf(hdr, sizeof(hdr), "%s %s: ", logger_timestamp(), ls->in->ident);
+	iov[1].iov_base = (void *)line;
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+
+	ret = writev(fd, iov, ARRAY_SIZE(iov));
+	if (ret > 0)
+		logger_file_written(lf, ret);
+
+	return true;
+}
+
+static void
+logger_emit(struct log_stream *ls, int prio, const char *line, size_t len)
+{
+	unsigned int n;
+	int hdr_len;
+
+	journal_add(ls->in, ls->stream, prio, line, len);
+
+	if (ls->in->log_file.path && logger_file_line(ls, line, len))
+		return;
+
+	if (batch.n == LOG_BATCH)
+		logger_flush();
+
+	n = batch.n++;
+
+	hdr_len = snprintf(batch.hdr[n], LOG_HDR_MAX, "<%d>%s %s: ",
+			   LOG_DAEMON | prio, logger_timestamp(), ls->in->ident);
+
+	batch.iov[n][0].iov_base = batch.hdr[n];
+	batch.iov[n][0].iov_len = hdr_len;
+	batch.iov[n][1].iov_base = (void *)line;
+	batch.iov[n][1].iov_len = len;
+
+	batch.msgs[n].msg_hdr.msg_iov = batch.iov[n];
+	batch.msgs[n].msg_hdr.msg_iovlen = 2;
+}
+
+static bool
+logger_limit(struct log_limit *l)
+{
+	struct timespec now;
+	uint64_t elapsed, n;
+
+	if (!l->rate)
+		return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed = (uint64_t) (now.tv_sec - l->refill.tv_sec) * 1000000000 +
+		  now.tv_nsec - l->refill.tv_nsec;
+	n = elapsed / 1000000 * l->rate / 1000;
+
+	if (n >= l->burst - l->tokens) {
+		l->tokens = l->burst;
+		l->refill = now;
+	} else if (n) {
+		/* Keep the remainder, so slow rates still accumulate tokens */
+		elapsed = n * 1000000000 / l->rate;
+		l->tokens += n;
+		l->refill.tv_sec += elapsed / 1000000000;
+		l->refill.tv_nsec += elapsed % 1000000000;
+		if (l->refill.tv_nsec >= 1000000000) {
+			l->refill.tv_sec++;
+			l->refill.tv_nsec -= 1000000000;
+		}
+	}
+
+	if (!l->tokens)
+		return false;
+
+	l->tokens--;
+	return true;
+}
+
+static void
+logger_suppressed(struct log_stream *ls)
+{
+	static char msg[64];
+	struct log_limit *l = &ls->in->log;
+	int len;
+
+	if (!l->suppressed)
+		return;
+
+	len = snprintf(msg, sizeof(msg), "%u messages suppressed", l->suppressed);
+	l->suppressed = 0;
+
+	/* msg is reused, so it must be sent right away */
+	logger_emit(ls, LOG_WARNING, msg, len);
+	logger_flush();
+}
+
+static void
+logger_line(struct log_stream *ls, const char *line, size_t len)
+{
+	struct log_limit *l = &ls->in->log;
+
+	l->lines++;
+
+	if (!logger_limit(l)) {
+		l->suppressed++;
+		l->dropped++;
+		return;
+	}
+
+	logger_suppressed(ls);
+	logger_emit(ls, ls->prio, line, len);
+}
+
+/* Returns the number of bytes at the start of the buffer that were consumed */
+static size_t
+logger_stream_lines(struct log_stream *ls)
+{
+	char *start = ls->buf, *end = ls->buf + ls->len, *newline;
+
+	while ((newline = memchr(start, '\n', end - start))) {
+		if (ls->truncating)
+			ls->truncating = false;
+		else
+			logger_line(ls, start, newline - start);
+
+		start = newline + 1;
+	}
+
+	/* Overlong line: log what we have and discard the rest */
+	if (start == ls->buf && ls->len == LOG_LINE_MAX) {
+		if (!ls->truncating)
+			logger_line(ls, start, ls->len);
+
+		ls->truncating = true;
+		start = end;
+	}
+
+	return start - ls->buf;
+}
+
+static void
+logger_stream_consume(struct log_stream *ls, size_t consumed)
+{
+	ls->len -= consumed;
+	memmove(ls->buf, ls->buf + consumed, ls->len);
+}
+
+static void
+logger_stream_process(struct log_stream *ls)
+{
+	size_t consumed = logger_stream_lines(ls);
+
+	/* Lines point into the stream buffer, so they must be sent first */
+	logger_flush();
+	logger_stream_consume(ls, consumed);
+}
+
+static void
+logger_stream_eof(struct log_stream *ls)
+{
+	if (ls->len && !ls->truncating)
+		logger_line(ls, ls->buf, ls->len);
+
+	logger_suppressed(ls);
+	logger_flush();
+
+	logger_stream_close(ls);
+}
+
+static void
+logger_stream_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	struct log_stream *ls = container_of(fd, struct log_stream, fd);
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < LOG_READS_MAX; i++) {
+		len = read(fd->fd, ls->buf + ls->len, LOG_LINE_MAX - ls->len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+		}
+
+		if (len <= 0) {
+			logger_stream_eof(ls);
+			return;
+		}
+
+		ls->in->log.bytes += len;
+		ls->len += len;
+		logger_stream_process(ls);
+	}
+}
+
+/* Raw mode for file systems without splice() support */
+static ssize_t
+logger_stream_copy(struct log_stream *ls, int out, size_t max)
+{
+	ssize_t len, ret;
+
+	len = read(ls->fd.fd, ls->buf, max < LOG_LINE_MAX ? max : LOG_LINE_MAX);
+	if (len <= 0)
+		return len;
+
+	ret = write(out, ls->buf, len);
+	return ret < 0 ? len : ret;
+}
+
+static void
+logger_stream_raw_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct log_stream *ls = container_of(fd, struct log_stream, fd);
+	struct log_file *lf = &ls->in->log_file;
+	size_t max;
+	ssize_t len;
+	int i, out;
+
+	for (i = 0; i < LOG_READS_MAX; i++) {
+		out = logger_file_get(lf);
+		if (out < 0) {
+			/* Fall back to syslog while the file is unavailable */
+			fd->cb = logger_stream_cb;
+			logger_stream_cb(fd, events);
+			return;
+		}
+
+		/* Never 0, logger_file_get() rotates full files */
+		max = LOG_SPLICE_MAX;
+		if (lf->max_size && lf->max_size - lf->size < max)
+			max = lf->max_size - lf->size;
+
+		if (ls->copy)
+			len = logger_stream_copy(ls, out, max);
+		else
+			len = splice(fd->fd, NULL, out, NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			if (errno == EINVAL && !ls->copy) {
+				ls->copy = true;
+				continue;
+			}
+		}
+
+		if (len <= 0) {
+			logger_stream_close(ls);
+			return;
+		}
+
+		ls->in->log.bytes += len;
+		logger_file_written(lf, len);
+	}
+}
+
+static bool
+logger_stream_submit(struct log_stream *ls)
+{
+	struct log_read *r = ls->read;
+
+	if (!uring_read(&r->req, ls->fd.fd, ls->buf + ls->len, LOG_LINE_MAX - ls->len))
+		return false;
+
+	r->pending = true;
+	return true;
+}
+
+static void
+logger_read_cb(struct uring_req *req, int res)
+{
+	struct log_read *r = container_of(req, struct log_read, req);
+	struct log_stream *ls = r->ls;
+
+	r->pending = false;
+
+	if (!ls) {
+		free(r);
+		return;
+	}
+
+	if (res == -EINTR || res == -EAGAIN) {
+		list_add_tail(&ls->pending, &pending_streams);
+		return;
+	}
+
+	/* The kernel does not support the read, fall back to uloop */
+	if (res == -EINVAL || res == -EOPNOTSUPP) {
+		fcntl(ls->fd.fd, F_SETFL, fcntl(ls->fd.fd, F_GETFL) | O_NONBLOCK);
+		uloop_fd_add(&ls->fd, ULOOP_READ);
+		return;
+	}
+
+	if (res <= 0) {
+		logger_stream_eof(ls);
+		return;
+	}
+
+	ls->in->log.bytes += res;
+	ls->len += res;
+	ls->consumed = logger_stream_lines(ls);
+	list_add_tail(&ls->pending, &pending_streams);
+}
+
+/*
+ * Called once all completions of a loop iteration have been handled, so
+ * the lines of all streams are sent to syslog with as few sendmmsg()
+ * calls as possible before the buffers are reused.
+ */
+static void
+logger_uring_done(void)
+{
+	struct log_stream *ls, *tmp;
+
+	logger_flush();
+
+	list_for_each_entry_safe(ls, tmp, &pending_streams, pending) {
+		list_del_init(&ls->pending);
+		logger_stream_consume(ls, ls->consumed);
+		ls->consumed = 0;
+
+		if (!logger_stream_submit(ls)) {
+			fcntl(ls->fd.fd, F_SETFL, fcntl(ls->fd.fd, F_GETFL) | O_NONBLOCK);
+			uloop_fd_add(&ls->fd, ULOOP_READ);
+		}
+	}
+}
+
+void
+logger_stream_open(struct log_stream *ls, int fd)
+{
+	bool raw = ls->in->log_file.path && ls->in->log_file.raw;
+
+	ls->read = calloc(1, sizeof(*ls->read));
+	if (!ls->read) {
+		close(fd);
+		return;
+	}
+
+	ls->read->ls = ls;
+	ls->read->req.cb = logger_read_cb;
+	ls->buf = ls->read->buf;
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	ls->len = 0;
+	ls->truncating = false;
+	ls->copy = false;
+	ls->fd.fd = fd;
+	ls->fd.cb = raw ? logger_stream_raw_cb : logger_stream_cb;
+
+	/* io_uring polls the pipe internally, so it is left blocking */
+	if (!raw && uring_available() && logger_stream_submit(ls)) {
+		uring_submit();
+		return;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	uloop_fd_add(&ls->fd, ULOOP_READ);
+}
+
+void
+logger_stream_close(struct log_stream *ls)
+{
+	if (ls->fd.fd < 0)
+		return;
+
+	list_del_init(&ls->pending);
+
+	if (ls->read->pending) {
+		ls->read->ls = NULL;
+		uring_cancel(&ls->read->req);
+	} else {
+		free(ls->read);
+	}
+
+	uloop_fd_delete(&ls->fd);
+	close(ls->fd.fd);
+	ls->fd.fd = -1;
+
+	ls->read = NULL;
+	ls->buf = NULL;
+}
+
+void
+logger_stream_init(struct log_stream *ls, struct service_instance *in, int stream, int prio)
+{
+	ls->fd.fd = -2;
+	ls->in = in;
+	ls->stream = stream;
+	ls->prio = prio;
+	INIT_LIST_HEAD(&ls->pending);
+}
+
+void
+logger_init(void)
+{
+	if (uring_init(logger_uring_done))
+		DEBUG(2, "Using io_uring for service output\n");
+
+#ifdef UNITD_LOG_THREAD
+	pthread_t thread;
+	sigset_t mask, old;
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+	if (pthread_create(&thread, NULL, logger_thread, NULL))
+		ERROR("Failed to start log thread\n");
+	else
+		pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <libubox/uloop.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Longer lines are truncated */
+#define LOG_LINE_MAX 1024
+
+/* Default output limit of an instance: lines per second and burst size */
+#define LOG_RATE_DEFAULT	200
+#define LOG_BURST_DEFAULT	2000
+
+struct service_instance;
+struct log_read;
+
+/*
+ * File sink for the output of an instance. In raw mode, the output is
+ * spliced into the file unmodified; otherwise, lines are written with a
+ * timestamp prefix instead of being sent to syslog. The file is rotated
+ * when it grows beyond max_size.
+ */
+struct log_file {
+	const char *path;
+	uint32_t max_size;
+	uint32_t rotate;
+	bool raw;
+
+	int fd;
+	bool failed;
+	uint64_t size;
+};
+
+/*
+ * Token bucket shared by the output streams of an instance, plus output
+ * statistics. A rate of 0 disables the limit.
+ */
+struct log_limit {
+	uint32_t rate;
+	uint32_t burst;
+
+	uint32_t tokens;
+	struct timespec refill;
+	uint32_t suppressed;
+
+	uint64_t lines;
+	uint64_t bytes;
+	uint64_t dropped;
+};
+
+/*
+ * Output pipe of an instance. fd.fd is -2 if output capture is disabled
+ * and -1 if it is enabled, but no pipe is open.
+ */
+struct log_stream {
+	struct uloop_fd fd;
+	struct service_instance *in;
+	int stream;
+	int prio;
+
+	bool truncating;
+	bool copy;
+	size_t len;
+	char *buf;
+
+	/* io_uring backend */
+	struct log_read *read;
+	struct list_head pending;
+	size_t consumed;
+};
+
+void logger_init(void);
+void logger_stream_init(struct log_stream *ls, struct service_instance *in, int stream, int prio);
+void logger_stream_open(struct log_stream *ls, int fd);
+void logger_stream_close(struct log_stream *ls);
+void logger_file_close(struct log_file *lf);
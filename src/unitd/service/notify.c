@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../unitd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "notify.h"
+
+/* Same limit as SCM_MAX_FD in the kernel */
+#define NOTIFY_MAX_FDS 253
+
+#define NOTIFY_FDNAME_MAX 255
+
+static struct uloop_fd notify_fd = { .fd = -1 };
+
+static bool
+notify_valid_fdname(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (!len || len > NOTIFY_FDNAME_MAX)
+		return false;
+
+	/* Names are passed colon-separated in LISTEN_FDNAMES */
+	return !strchr(name, ':');
+}
+
+static void
+notify_handle(struct service_instance *in, char *msg, int *fds, int n_fds)
+{
+	const char *fdname = "stored";
+	bool fdstore = false, fdstore_remove = false, ready = false;
+	char *line, *saveptr;
+	int i;
+
+	for (line = strtok_r(msg, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		if (!strcmp(line, "READY=1"))
+			ready = true;
+		else if (!strcmp(line, "FDSTORE=1"))
+			fdstore = true;
+		else if (!strcmp(line, "FDSTOREREMOVE=1"))
+			fdstore_remove = true;
+		else if (!strncmp(line, "FDNAME=", 7))
+			fdname = line + 7;
+	}
+
+	if (ready && !in->ready) {
+		DEBUG(2, "Instance %s::%s is ready\n", in->srv->name, in->name);
+		in->ready = true;
+		instance_touch(in);
+	}
+
+	if (!notify_valid_fdname(fdname)) {
+		WARN("Instance %s::%s sent invalid fd name\n", in->srv->name, in->name);
+		return;
+	}
+
+	if (fdstore_remove) {
+		DEBUG(2, "Instance %s::%s removes stored fds %s\n", in->srv->name, in->name, fdname);
+		instance_fdstore_remove(in, fdname);
+	}
+
+	if (!fdstore)
+		return;
+
+	for (i = 0; i < n_fds; i++) {
+		if (instance_fdstore_add(in, fds[i], fdname)) {
+			WARN("Instance %s::%s exceeds its fd store limit of %u\n",
+			     in->srv->name, in->name, in->fdstore_max);
+			return;
+		}
+
+		/* Ownership was transferred to the instance */
+		fds[i] = -1;
+	}
+
+	DEBUG(2, "Instance %s::%s stored %d fds as %s\n", in->srv->name, in->name, n_fds, fdname);
+}
+
+static void
+notify_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
+			    CMSG_SPACE(sizeof(int) * NOTIFY_MAX_FDS)];
+	} control;
+	char buf[4096];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = sizeof(buf) - 1,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &control,
+		.msg_controllen = sizeof(control),
+	};
+
+	while (true) {
+		struct service_instance *in;
+		struct ucred *cred = NULL;
+		struct cmsghdr *cmsg;
+		int *fds = NULL, n_fds = 0, i;
+		ssize_t len;
+
+		mh.msg_controllen = sizeof(control);
+
+		len = recvmsg(fd->fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				ERROR("Failed to receive notification: %s\n", strerror(errno));
+			return;
+		}
+
+		buf[len] = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+
+			if (cmsg->cmsg_type == SCM_CREDENTIALS &&
+			    cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred))) {
+				cred = (struct ucred *)CMSG_DATA(cmsg);
+			} else if (cmsg->cmsg_type == SCM_RIGHTS) {
+				fds = (int *)CMSG_DATA(cmsg);
+				n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			}
+		}
+
+		in = cred ? service_find_instance_by_pid(cred->pid) : NULL;
+		if (in)
+			notify_handle(in, buf, fds, n_fds);
+		else
+			DEBUG(2, "Ignoring notification from unknown process\n");
+
+		for (i = 0; i < n_fds; i++) {
+			if (fds[i] >= 0)
+				close(fds[i]);
+		}
+	}
+}
+
+void
+notify_init(void)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+		.sun_path = NOTIFY_SOCKET_PATH,
+	};
+	int one = 1;
+
+	mkdir("/run/unitd", 0755);
+	unlink(NOTIFY_SOCKET_PATH);
+
+	notify_fd.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (notify_fd.fd < 0) {
+		ERROR("Failed to create notify socket: %s\n", strerror(errno));
+		return;
+	}
+
+	/* Instances running as other users need to be able to connect */
+	if (setsockopt(notify_fd.fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) ||
+	    bind(notify_fd.fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    chmod(NOTIFY_SOCKET_PATH, 0666)) {
+		ERROR("Failed to set up notify socket: %s\n", strerror(errno));
+		close(notify_fd.fd);
+		notify_fd.fd = -1;
+		return;
+	}
+
+	notify_fd.cb = notify_cb;
+	uloop_fd_add(&notify_fd, ULOOP_READ);
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "../unitd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "pressure.h"
+
+#define PRESSURE_SYSTEM		"/proc/pressure/memory"
+
+/* Trigger on 150ms of partial memory stall within a 1s window */
+#define PRESSURE_TRIGGER	"some 150000 1000000"
+
+/* Minimum time between two actions on the same instance in seconds */
+#define PRESSURE_HOLDOFF	30
+
+/*
+ * PSI triggers signal POLLPRI, which uloop can't wait for. The trigger fds
+ * are kept in a separate epoll instance, which becomes readable whenever
+ * one of them fires.
+ */
+static struct uloop_fd pressure_fd = { .fd = -1 };
+static int system_fd = -1;
+
+static unsigned int system_events;
+static struct timespec system_last;
+static unsigned int actions_taken;
+
+static int
+pressure_trigger_open(const char *path, void *ptr)
+{
+	struct epoll_event ev = {
+		.events = EPOLLPRI,
+		.data.ptr = ptr,
+	};
+	int fd;
+
+	if (pressure_fd.fd < 0)
+		return -1;
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		DEBUG(2, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (write(fd, PRESSURE_TRIGGER, strlen(PRESSURE_TRIGGER) + 1) < 0 ||
+	    epoll_ctl(pressure_fd.fd, EPOLL_CTL_ADD, fd, &ev)) {
+		ERROR("Failed to register pressure trigger on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+pressure_trigger_close(int fd)
+{
+	epoll_ctl(pressure_fd.fd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
+
+static void
+pressure_act(struct service_instance *in, struct timespec *now)
+{
+	const char *action;
+
+	if (!in->proc.pending)
+		return;
+
+	/* the event count is dumped, so list caches must see every change */
+	in->pressure.events++;
+	instance_touch(in);
+
+	if (in->pressure.last.tv_sec &&
+	    now->tv_sec - in->pressure.last.tv_sec < PRESSURE_HOLDOFF)
+		return;
+
+	in->pressure.last = *now;
+	actions_taken++;
+
+	switch (in->pressure.action) {
+	case PRESSURE_ACTION_NOTIFY:
+		action = "notify";
+		break;
+
+	case PRESSURE_ACTION_RELOAD:
+		action = "reload";
+		instance_reload(in);
+		break;
+
+	case PRESSURE_ACTION_STOP:
+		action = "stop";
+		instance_stop(in);
+		break;
+
+	default:
+		return;
+	}
+
+	LOG("Memory pressure on instance %s::%s, action: %s\n", in->srv->name, in->name, action);
+	service_event_pressure(in->srv->name, in->name, action);
+}
+
+static void
+pressure_system(struct timespec *now)
+{
+	struct service_instance *in;
+	struct service *s;
+
+	system_events++;
+	system_last = *now;
+
+	DEBUG(2, "System memory pressure\n");
+
+	avl_for_each_element(&services, s, avl) {
+		vlist_for_each_element(&s->instances, in, node) {
+			/* Instances with a cgroup are handled by their own trigger */
+			if (in->pressure.action && !in->pressure.cgroup)
+				pressure_act(in, now);
+		}
+	}
+}
+
+static void
+pressure_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	struct epoll_event ev[8];
+	struct timespec now;
+	int i, n;
+
+	n = epoll_wait(fd->fd, ev, ARRAY_SIZE(ev), 0);
+	if (n <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < n; i++) {
+		struct service_instance *in = ev[i].data.ptr;
+
+		if (!in) {
+			if (ev[i].events & EPOLLERR) {
+				ERROR("System pressure trigger failed\n");
+				pressure_trigger_close(system_fd);
+				system_fd = -1;
+			} else {
+				pressure_system(&now);
+			}
+			continue;
+		}
+
+		if (ev[i].events & EPOLLERR) {
+			/* The cgroup is gone */
+			pressure_unregister(in);
+			continue;
+		}
+
+		pressure_act(in, &now);
+	}
+}
+
+void
+pressure_register(struct service_instance *in)
+{
+	char path[256];
+
+	if (in->pressure.fd >= 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/memory.pressure", in->pressure.cgroup);
+	in->pressure.fd = pressure_trigger_open(path, in);
+}
+
+void
+pressure_unregister(struct service_instance *in)
+{
+	if (in->pressure.fd < 0)
+		return;
+
+	pressure_trigger_close(in->pressure.fd);
+	in->pressure.fd = -1;
+}
+
+void
+pressure_dump(struct blob_buf *b)
+{
+	void *c;
+
+	c = blobmsg_open_table(b, "system");
+	blobmsg_add_u8(b, "monitored", system_fd >= 0);
+	blobmsg_add_u32(b, "events", system_events);
+	if (system_events)
+		blobmsg_add_u32(b, "last", system_last.tv_sec);
+	blobmsg_close_table(b, c);
+
+	blobmsg_add_u32(b, "actions", actions_taken);
+}
+
+void
+pressure_init(void)
+{
+	pressure_fd.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (pressure_fd.fd < 0) {
+		ERROR("Failed to create epoll instance for pressure triggers: %s\n", strerror(errno));
+		return;
+	}
+
+	pressure_fd.cb = pressure_cb;
+	uloop_fd_add(&pressure_fd, ULOOP_READ);
+
+	system_fd = pressure_trigger_open(PRESSURE_SYSTEM, NULL);
+}
@@ -22,10 +22,124 @@
 
 #include "service.h"
 #include "instance.h"
+#include "pressure.h"
+#include "notify.h"
+#include "logger.h"
+#include "journal.h"
+#include "wait.h"
+#include "data.h"
+#include "status.h"
+#include "control.h"
 
 struct avl_tree services;
+uint64_t service_generation;
 static struct blob_buf b;
+
+/*
+ * Recently deleted services and instances, so list requests with a
+ * "since" generation can report them. Requests older than the oldest
+ * dropped entry get a "reset" flag instead.
+ */
+#define SERVICE_REMOVED_MAX 64
+
+static struct {
+	char *service;
+	char *instance;
+	uint64_t generation;
+} removed[SERVICE_REMOVED_MAX];
+static unsigned int removed_next;
+static uint64_t removed_floor;
+
+/*
+ * Replies to recent list requests, valid until the generation changes.
+ * Replies including output counters, which do not bump the generation,
+ * are only reused for SERVICE_LIST_CACHE_TIME seconds.
+ */
+#define SERVICE_LIST_CACHE_MAX	4
+#define SERVICE_LIST_CACHE_TIME	1
+
+static struct {
+	struct blob_attr *msg;
+	struct blob_attr *reply;
+	uint64_t generation;
+	bool counters;
+	time_t time;			/* CLOCK_MONOTONIC, unaffected by clock steps */
+} list_cache[SERVICE_LIST_CACHE_MAX];
+static unsigned int list_cache_next;
+
+static struct blob_buf diff;
+static struct blob_buf reply;
 static struct ubus_context *ctx;
+static struct ubus_object main_object;
+static bool connected;
+
+/*
+ * Notifications raised while ubus is not connected are kept in a
+ * bounded queue, dropping the oldest, and sent once there are
+ * subscribers again after the connection has been made.
+ */
+#define SERVICE_QUEUE_MAX 64
+
+static struct {
+	char *type;
+	struct blob_attr *msg;
+} notify_queue[SERVICE_QUEUE_MAX];
+static unsigned int queue_head, queue_len, queue_dropped;
+
+/*
+ * Start, stop and reload events are collected for event_window
+ * milliseconds (unitd.event_window= on the kernel command line) and sent
+ * as one "service.events" notification per service. A batch holding a
+ * single event is sent as that event, as without coalescing.
+ */
+#define SERVICE_EVENT_WINDOW	50
+#define SERVICE_EVENT_MAX	64
+
+struct event_batch {
+	struct avl_node avl;
+	struct list_head events;
+	unsigned int count;
+	unsigned int dropped;
+};
+
+struct event {
+	struct list_head list;
+	const char *type;
+	char *instance;
+};
+
+static struct avl_tree event_batches;
+static unsigned int event_window = SERVICE_EVENT_WINDOW;
+static void service_event_flush(struct uloop_timeout *t);
+static struct uloop_timeout event_timeout = {
+	.cb = service_event_flush,
+};
+
+static void service_event_removed(struct service *s, struct service_instance *in,
+				  uint64_t generation);
+
+/*
+ * While a batch is applied, instance starts are queued instead, so all
+ * stops happen first. Instances restarted by the batch are queued when
+ * they have exited. The queue is worked off SERVICE_START_PACE instances
+ * at a time once all of them have exited, or after
+ * SERVICE_STOP_TIMEOUT at the latest.
+ */
+#define SERVICE_START_PACE	4
+#define SERVICE_START_INTERVAL	20
+#define SERVICE_STOP_TIMEOUT	5000
+
+static bool service_batching;
+static unsigned int batch_stopping;
+static LIST_HEAD(start_queue);
+static void service_start_queued(struct uloop_timeout *t);
+static struct uloop_timeout start_timeout = {
+	.cb = service_start_queued,
+};
+static void service_stop_timeout(struct uloop_timeout *t);
+static struct uloop_timeout stop_timeout = {
+	.cb = service_stop_timeout,
+};
 
 static void
 service_instance_add(struct service *s, struct blob_attr *attr)
@@ -35,6 +149,15 @@ service_instance_add(struct service *s, struct blob_attr *attr)
 	if (blobmsg_type(attr) != BLOBMSG_TYPE_TABLE)
 		return;
 
+	/* Short-cut unchanged instances before allocating and parsing anything */
+	in = vlist_find(&s->instances, blobmsg_name(attr), in, node);
+	if (in && instance_config_unchanged(in, attr)) {
+		in->node.version = s->instances.version;
+		if (!in->proc.pending)
+			instance_start(in);
+		return;
+	}
+
 	in = calloc(1, sizeof(*in));
 	if (!in)
 		return;
@@ -43,8 +166,88 @@ service_instance_add(struct service *s, struct blob_attr *attr)
 	vlist_add(&s->instances, &in->node, (void *) in->name);
 }
 
+/* Whether building a notification is worth it */
+static bool
+service_notify_wanted(void)
+{
+	return !connected || main_object.has_subscribers;
+}
+
+static void
+service_notify(const char *type, struct blob_attr *msg)
+{
+	unsigned int i;
+
+	if (connected) {
+		if (main_object.has_subscribers)
+			ubus_notify(ctx, &main_object, type, msg, -1);
+		return;
+	}
+
+	if (queue_len == SERVICE_QUEUE_MAX) {
+		i = queue_head++ % SERVICE_QUEUE_MAX;
+		free(notify_queue[i].type);
+		free(notify_queue[i].msg);
+		queue_len--;
+		queue_dropped++;
+	}
+
+	i = (queue_head + queue_len) % SERVICE_QUEUE_MAX;
+	notify_queue[i].type = strdup(type);
+	notify_queue[i].msg = blob_memdup(msg);
+	queue_len++;
+}
+
+static void
+service_notify_replay(void)
+{
+	unsigned int i;
+
+	if (!connected || !main_object.has_subscribers || !queue_len)
+		return;
+
+	if (queue_dropped)
+		WARN("Dropped %u notifications while ubus was not connected\n", queue_dropped);
+
+	for (; queue_len; queue_len--) {
+		i = queue_head++ % SERVICE_QUEUE_MAX;
+		if (notify_queue[i].type && notify_queue[i].msg)
+			ubus_notify(ctx, &main_object, notify_queue[i].type, notify_queue[i].msg, -1);
+		free(notify_queue[i].type);
+		free(notify_queue[i].msg);
+		notify_queue[i].type = NULL;
+		notify_queue[i].msg = NULL;
+	}
+
+	queue_dropped = 0;
+}
+
+void
+service_touch(struct service *s)
+{
+	s->generation = ++service_generation;
+}
+
 static void
-service_instance_update(UNUSED struct vlist_tree *tree, struct vlist_node *node_new,
+service_removed(struct service *s, struct service_instance *in)
+{
+	unsigned int i = removed_next++ % SERVICE_REMOVED_MAX;
+
+	if (removed[i].service) {
+		removed_floor = removed[i].generation;
+		free(removed[i].service);
+		free(removed[i].instance);
+	}
+
+	removed[i].service = strdup(s->name);
+	removed[i].instance = in ? strdup(in->name) : NULL;
+	removed[i].generation = ++service_generation;
+
+	service_event_removed(s, in, removed[i].generation);
+}
+
+static void
+service_instance_update(struct vlist_tree *tree, struct vlist_node *node_new,
 			struct vlist_node *node_old)
 {
 	struct service_instance *in_o = NULL, *in_n = NULL;
@@ -59,14 +262,22 @@ service_instance_update(UNUSED struct vlist_tree *tree, struct vlist_node *node_
 		DEBUG(2, "Update instance %s::%s\n", in_o->srv->name, in_o->name);
 		instance_update(in_o, in_n);
 		instance_free(in_n);
+		data_index(in_o);
+		instance_touch(in_o);
 	} else if (in_o) {
 		DEBUG(2, "Free instance %s::%s\n", in_o->srv->name, in_o->name);
 		instance_stop(in_o);
+		service_removed(in_o->srv, in_o);
 		instance_free(in_o);
 	} else if (in_n) {
 		DEBUG(2, "Create instance %s::%s\n", in_n->srv->name, in_n->name);
+		data_index(in_n);
 		instance_start(in_n);
+		instance_touch(in_n);
 	}
+
+	service_touch(container_of(tree, struct service, instances));
+
 	blob_buf_init(&b, 0);
 }
 
@@ -91,6 +302,8 @@ enum {
 	SERVICE_SET_NAME,
 	SERVICE_SET_SCRIPT,
 	SERVICE_SET_INSTANCES,
+	SERVICE_SET_WAIT,
+	SERVICE_SET_TIMEOUT,
 	__SERVICE_SET_MAX
 };
 
@@ -98,6 +311,8 @@ static const struct blobmsg_policy service_set_attrs[__SERVICE_SET_MAX] = {
 	[SERVICE_SET_NAME] = { "name", BLOBMSG_TYPE_STRING },
 	[SERVICE_SET_SCRIPT] = { "script", BLOBMSG_TYPE_STRING },
 	[SERVICE_SET_INSTANCES] = { "instances", BLOBMSG_TYPE_TABLE },
+	[SERVICE_SET_WAIT] = { "wait", BLOBMSG_TYPE_STRING },
+	[SERVICE_SET_TIMEOUT] = { "timeout", BLOBMSG_TYPE_INT32 },
 };
 
 static int
@@ -123,6 +338,7 @@ static void
 service_delete(struct service *s)
 {
 	service_event("service.stop", s->name, NULL);
+	service_removed(s, NULL);
 	vlist_flush_all(&s->instances);
 	avl_delete(&services, &s->avl);
 	free(s);
@@ -140,23 +356,35 @@ static const struct blobmsg_policy service_attrs[__SERVICE_ATTR_MAX] = {
 enum {
 	SERVICE_DEL_ATTR_NAME,
 	SERVICE_DEL_ATTR_INSTANCE,
+	SERVICE_DEL_ATTR_WAIT,
+	SERVICE_DEL_ATTR_TIMEOUT,
 	__SERVICE_DEL_ATTR_MAX,
 };
 
 static const struct blobmsg_policy service_del_attrs[__SERVICE_DEL_ATTR_MAX] = {
 	[SERVICE_DEL_ATTR_NAME] = { "name", BLOBMSG_TYPE_STRING },
 	[SERVICE_DEL_ATTR_INSTANCE] = { "instance", BLOBMSG_TYPE_STRING },
+	[SERVICE_DEL_ATTR_WAIT] = { "wait", BLOBMSG_TYPE_BOOL },
+	[SERVICE_DEL_ATTR_TIMEOUT] = { "timeout", BLOBMSG_TYPE_INT32 },
 };
 
 enum {
 	SERVICE_LIST_ATTR_NAME,
 	SERVICE_LIST_ATTR_VERBOSE,
+	SERVICE_LIST_ATTR_CURSOR,
+	SERVICE_LIST_ATTR_LIMIT,
+	SERVICE_LIST_ATTR_FIELDS,
+	SERVICE_LIST_ATTR_SINCE,
 	__SERVICE_LIST_ATTR_MAX,
 };
 
 static const struct blobmsg_policy service_list_attrs[__SERVICE_LIST_ATTR_MAX] = {
 	[SERVICE_LIST_ATTR_NAME] = { "name", BLOBMSG_TYPE_STRING },
 	[SERVICE_LIST_ATTR_VERBOSE] = { "verbose", BLOBMSG_TYPE_BOOL },
+	[SERVICE_LIST_ATTR_CURSOR] = { "cursor", BLOBMSG_TYPE_STRING },
+	[SERVICE_LIST_ATTR_LIMIT] = { "limit", BLOBMSG_TYPE_INT32 },
+	[SERVICE_LIST_ATTR_FIELDS] = { "fields", BLOBMSG_TYPE_ARRAY },
+	[SERVICE_LIST_ATTR_SINCE] = { "since", BLOBMSG_TYPE_INT64 },
 };
 
 enum {
@@ -183,15 +411,30 @@ static const struct blobmsg_policy get_data_policy[] = {
 	[DATA_TYPE] = { "type", BLOBMSG_TYPE_STRING },
 };
 
+static uint32_t
+service_wait_timeout(struct blob_attr *attr)
+{
+	if (!attr)
+		return WAIT_TIMEOUT_DEFAULT;
+
+	return blobmsg_get_u32(attr);
+}
+
+/*
+ * With "wait" set to "running" or "ready", the reply is deferred until
+ * all instances of the service are running, or have also signalled
+ * readiness through the notify socket, or the timeout has passed.
+ */
 static int
-service_handle_set(UNUSED struct ubus_context *ctx, UNUSED struct ubus_object *obj,
-		   UNUSED struct ubus_request_data *req, const char *method,
+service_handle_set(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+		   struct ubus_request_data *req, const char *method,
 		   struct blob_attr *msg)
 {
 	struct blob_attr *tb[__SERVICE_SET_MAX], *cur;
 	struct service *s = NULL;
 	const char *name;
 	bool add = !strcmp(method, "add");
+	enum wait_cond cond = WAIT_RUNNING;
 	int ret;
 
 	blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, tb, blob_data(msg), blob_len(msg));
@@ -199,32 +442,440 @@ service_handle_set(UNUSED struct ubus_context *ctx, UNUSED struct ubus_object *o
 	if (!cur)
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	name = blobmsg_data(cur);
+	cur = tb[SERVICE_SET_WAIT];
+	if (cur) {
+		if (!strcmp(blobmsg_data(cur), "ready"))
+			cond = WAIT_READY;
+		else if (strcmp(blobmsg_data(cur), "running"))
+			return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	name = blobmsg_data(tb[SERVICE_ATTR_NAME]);
 
 	s = avl_find_element(&services, name, s, avl);
 	if (s) {
 		DEBUG(2, "Update service %s\n", name);
-		return service_update(s, tb, add);
+		ret = service_update(s, tb, add);
+	} else {
+		DEBUG(2, "Create service %s\n", name);
+		s = service_alloc(name);
+		if (!s)
+			return UBUS_STATUS_UNKNOWN_ERROR;
+
+		ret = service_update(s, tb, add);
+		if (ret)
+			return ret;
+
+		avl_insert(&services, &s->avl);
+		service_touch(s);
+
+		service_event("service.start", s->name, NULL);
 	}
 
-	DEBUG(2, "Create service %s\n", name);
-	s = service_alloc(name);
-	if (!s)
-		return UBUS_STATUS_UNKNOWN_ERROR;
+	if (!ret && req && tb[SERVICE_SET_WAIT])
+		wait_instances(ctx, req, s, cond, service_wait_timeout(tb[SERVICE_SET_TIMEOUT]));
+
+	return ret;
+}
+
+enum {
+	SERVICE_DIFF_ATTR_NAME,
+	SERVICE_DIFF_ATTR_INSTANCES,
+	SERVICE_DIFF_ATTR_ADD,
+	__SERVICE_DIFF_ATTR_MAX,
+};
+
+/* Same as for set, plus whether to compare against add semantics */
+static const struct blobmsg_policy service_diff_attrs[__SERVICE_DIFF_ATTR_MAX] = {
+	[SERVICE_DIFF_ATTR_NAME] = { "name", BLOBMSG_TYPE_STRING },
+	[SERVICE_DIFF_ATTR_INSTANCES] = { "instances", BLOBMSG_TYPE_TABLE },
+	[SERVICE_DIFF_ATTR_ADD] = { "add", BLOBMSG_TYPE_BOOL },
+};
+
+static bool
+service_diff_listed(struct blob_attr *instances, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, instances, rem) {
+		if (!strcmp(blobmsg_name(cur), name))
+			return true;
+	}
+
+	return false;
+}
+
+static const char * const diff_actions[] = {
+	[INSTANCE_ACTION_NONE] = "none",
+	[INSTANCE_ACTION_RELOAD] = "reload",
+	[INSTANCE_ACTION_RESTART] = "restart",
+};
+
+static void
+service_diff_instance(struct service *s, struct blob_attr *attr)
+{
+	struct service_instance *in, *in_new;
+	const char *action = "none";
+	unsigned int diff = 0;
+	void *c, *f;
+	int i;
+
+	in = s ? vlist_find(&s->instances, blobmsg_name(attr), in, node) : NULL;
+	if (in && instance_config_unchanged(in, attr)) {
+		c = blobmsg_open_table(&b, blobmsg_name(attr));
+		blobmsg_add_string(&b, "action", in->proc.pending ? "none" : "start");
+		blobmsg_close_table(&b, c);
+		return;
+	}
+
+	in_new = calloc(1, sizeof(*in_new));
+	if (!in_new)
+		return;
+
+	instance_init(in_new, s, attr);
+
+	if (!in) {
+		action = "create";
+	} else {
+		diff = instance_config_diff(in, in_new);
+		if (!in->proc.pending)
+			action = "start";
+		else if (diff)
+			action = diff_actions[instance_diff_action(diff, in_new)];
+	}
+
+	c = blobmsg_open_table(&b, blobmsg_name(attr));
+	blobmsg_add_string(&b, "action", action);
+	if (!in_new->valid)
+		blobmsg_add_u8(&b, "valid", false);
+	if (diff) {
+		f = blobmsg_open_array(&b, "fields");
+		for (i = 0; i < __INSTANCE_FIELD_MAX; i++) {
+			if (diff & (1U << i))
+				blobmsg_add_string(&b, NULL, instance_fields[i].name);
+		}
+		blobmsg_close_array(&b, f);
+	}
+	blobmsg_close_table(&b, c);
+
+	instance_free(in_new);
+}
+
+/*
+ * Reports what a set or add with the same arguments would do to each
+ * instance, without changing anything. Instances are created, started,
+ * restarted, reloaded, deleted, or left alone ("none"); for changed
+ * instances the differing fields are listed.
+ */
+static int
+service_handle_diff(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+		    struct ubus_request_data *req, UNUSED const char *method,
+		    struct blob_attr *msg)
+{
+	struct blob_attr *tb[__SERVICE_SET_MAX], *dtb[__SERVICE_DIFF_ATTR_MAX], *cur;
+	struct service *s;
+	struct service tmp = { .name = NULL };
+	struct service_instance *in;
+	bool add = false;
+	void *c;
+	int rem;
+
+	blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[SERVICE_SET_NAME])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	blobmsg_parse(service_diff_attrs, __SERVICE_DIFF_ATTR_MAX, dtb, blob_data(msg), blob_len(msg));
+	if (dtb[SERVICE_DIFF_ATTR_ADD])
+		add = blobmsg_get_bool(dtb[SERVICE_DIFF_ATTR_ADD]);
+
+	s = avl_find_element(&services, blobmsg_data(tb[SERVICE_SET_NAME]), s, avl);
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u8(&b, "create", !s);
+
+	if (!s) {
+		tmp.name = blobmsg_data(tb[SERVICE_SET_NAME]);
+		vlist_init(&tmp.instances, avl_strcmp, NULL);
+	}
+
+	c = blobmsg_open_table(&b, "instances");
+	if (tb[SERVICE_SET_INSTANCES]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_SET_INSTANCES], rem) {
+			if (blobmsg_type(cur) == BLOBMSG_TYPE_TABLE)
+				service_diff_instance(s ? s : &tmp, cur);
+		}
+	}
 
-	ret = service_update(s, tb, add);
-	if (ret)
-		return ret;
+	/* Like set, instances missing from the request are deleted */
+	if (s && tb[SERVICE_SET_INSTANCES] && !add) {
+		vlist_for_each_element(&s->instances, in, node) {
+			void *i;
 
-	avl_insert(&services, &s->avl);
+			if (service_diff_listed(tb[SERVICE_SET_INSTANCES], in->name))
+				continue;
 
-	service_event("service.start", s->name, NULL);
+			i = blobmsg_open_table(&b, in->name);
+			blobmsg_add_string(&b, "action", "delete");
+			blobmsg_close_table(&b, i);
+		}
+	}
+	blobmsg_close_table(&b, c);
+
+	ubus_send_reply(ctx, req, b.head);
 
 	return 0;
 }
 
 static void
-service_dump(struct service *s, bool verbose)
+service_start_queue_run(void)
+{
+	if (service_batching || batch_stopping || start_timeout.pending)
+		return;
+
+	uloop_timeout_cancel(&stop_timeout);
+	if (!list_empty(&start_queue))
+		service_start_queued(&start_timeout);
+}
+
+static void
+service_start_enqueue(struct service_instance *in)
+{
+	if (list_empty(&in->start_queue))
+		list_add_tail(&in->start_queue, &start_queue);
+	in->batch_start = true;
+}
+
+bool
+service_start_deferred(struct service_instance *in)
+{
+	if (!service_batching)
+		return false;
+
+	service_start_enqueue(in);
+	return true;
+}
+
+void
+service_restart_deferred(struct service_instance *in)
+{
+	if (!service_batching || in->batch_restart)
+		return;
+
+	in->batch_restart = true;
+	batch_stopping++;
+}
+
+/* Queues an instance restarted by a batch once it has exited */
+void
+service_restart_exited(struct service_instance *in)
+{
+	in->batch_restart = false;
+	if (batch_stopping)
+		batch_stopping--;
+
+	if (in->restart && !in->halt)
+		service_start_enqueue(in);
+
+	service_start_queue_run();
+}
+
+/* Called for an instance restarted by a batch that is freed before it exits */
+void
+service_restart_cancel(struct service_instance *in)
+{
+	if (!in->batch_restart)
+		return;
+
+	in->batch_restart = false;
+	if (batch_stopping)
+		batch_stopping--;
+
+	service_start_queue_run();
+}
+
+static void
+service_stop_timeout(UNUSED struct uloop_timeout *t)
+{
+	LOG("%u instances did not stop in time, starting queued instances\n", batch_stopping);
+	batch_stopping = 0;
+	service_start_queue_run();
+}
+
+static void
+service_start_queued(UNUSED struct uloop_timeout *t)
+{
+	struct service_instance *in;
+	unsigned int i;
+
+	for (i = 0; i < SERVICE_START_PACE && !list_empty(&start_queue); i++) {
+		in = list_first_entry(&start_queue, struct service_instance, start_queue);
+		list_del_init(&in->start_queue);
+		instance_start(in);
+		in->batch_start = false;
+	}
+
+	if (!list_empty(&start_queue))
+		uloop_timeout_set(&start_timeout, SERVICE_START_INTERVAL);
+}
+
+enum {
+	SERVICE_APPLY_ATTR_SERVICES,
+	SERVICE_APPLY_ATTR_DELETE,
+	SERVICE_APPLY_ATTR_ADD,
+	__SERVICE_APPLY_ATTR_MAX,
+};
+
+static const struct blobmsg_policy service_apply_attrs[__SERVICE_APPLY_ATTR_MAX] = {
+	[SERVICE_APPLY_ATTR_SERVICES] = { "services", BLOBMSG_TYPE_TABLE },
+	[SERVICE_APPLY_ATTR_DELETE] = { "delete", BLOBMSG_TYPE_ARRAY },
+	[SERVICE_APPLY_ATTR_ADD] = { "add", BLOBMSG_TYPE_BOOL },
+};
+
+static bool
+service_apply_valid(const char *name, struct blob_attr *attr)
+{
+	struct blob_attr *tb[__SERVICE_SET_MAX], *cur;
+	struct service_instance *in;
+	struct service tmp = { .name = name };
+	bool valid = true;
+	int rem;
+
+	if (blobmsg_type(attr) != BLOBMSG_TYPE_TABLE)
+		return false;
+
+	blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, tb, blobmsg_data(attr), blobmsg_data_len(attr));
+	if (!tb[SERVICE_SET_INSTANCES])
+		return true;
+
+	blobmsg_for_each_attr(cur, tb[SERVICE_SET_INSTANCES], rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE)
+			return false;
+
+		in = calloc(1, sizeof(*in));
+		if (!in)
+			return false;
+
+		instance_init(in, &tmp, cur);
+		valid = in->valid;
+		instance_free(in);
+		if (!valid) {
+			LOG("Rejecting batch, invalid instance %s::%s\n", name, blobmsg_name(cur));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Applies the configuration of several services as one transaction:
+ * everything is validated before anything is changed, instances are
+ * stopped first and started afterwards, paced by the start queue, and a
+ * single service.apply notification is sent instead of per-service events.
+ * This includes instances restarted because of a changed configuration.
+ * instance.state notifications are still sent, they track state rather
+ * than report actions.
+ */
+static int
+service_handle_apply(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+		     struct ubus_request_data *req, UNUSED const char *method,
+		     struct blob_attr *msg)
+{
+	struct blob_attr *tb[__SERVICE_APPLY_ATTR_MAX], *stb[__SERVICE_SET_MAX], *cur;
+	struct service *s;
+	bool add = false;
+	void *added, *updated, *deleted;
+	int rem;
+
+	blobmsg_parse(service_apply_attrs, __SERVICE_APPLY_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[SERVICE_APPLY_ATTR_SERVICES] && !tb[SERVICE_APPLY_ATTR_DELETE])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (tb[SERVICE_APPLY_ATTR_ADD])
+		add = blobmsg_get_bool(tb[SERVICE_APPLY_ATTR_ADD]);
+
+	if (tb[SERVICE_APPLY_ATTR_SERVICES]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_APPLY_ATTR_SERVICES], rem) {
+			if (!service_apply_valid(blobmsg_name(cur), cur))
+				return UBUS_STATUS_INVALID_ARGUMENT;
+		}
+	}
+
+	if (tb[SERVICE_APPLY_ATTR_DELETE]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_APPLY_ATTR_DELETE], rem) {
+			if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+				return UBUS_STATUS_INVALID_ARGUMENT;
+			if (!avl_find(&services, blobmsg_data(cur)))
+				return UBUS_STATUS_NOT_FOUND;
+		}
+	}
+
+	service_batching = true;
+
+	blob_buf_init(&reply, 0);
+	deleted = blobmsg_open_array(&reply, "deleted");
+	if (tb[SERVICE_APPLY_ATTR_DELETE]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_APPLY_ATTR_DELETE], rem) {
+			s = avl_find_element(&services, blobmsg_data(cur), s, avl);
+			if (!s)
+				continue;
+
+			blobmsg_add_string(&reply, NULL, s->name);
+			service_delete(s);
+		}
+	}
+	blobmsg_close_array(&reply, deleted);
+
+	updated = blobmsg_open_array(&reply, "updated");
+	if (tb[SERVICE_APPLY_ATTR_SERVICES]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_APPLY_ATTR_SERVICES], rem) {
+			s = avl_find_element(&services, blobmsg_name(cur), s, avl);
+			if (!s)
+				continue;
+
+			blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, stb, blobmsg_data(cur), blobmsg_data_len(cur));
+			DEBUG(2, "Update service %s\n", s->name);
+			service_update(s, stb, add);
+			blobmsg_add_string(&reply, NULL, s->name);
+		}
+	}
+	blobmsg_close_array(&reply, updated);
+
+	added = blobmsg_open_array(&reply, "added");
+	if (tb[SERVICE_APPLY_ATTR_SERVICES]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_APPLY_ATTR_SERVICES], rem) {
+			if (avl_find(&services, blobmsg_name(cur)))
+				continue;
+
+			DEBUG(2, "Create service %s\n", blobmsg_name(cur));
+			s = service_alloc(blobmsg_name(cur));
+			if (!s)
+				continue;
+
+			blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, stb, blobmsg_data(cur), blobmsg_data_len(cur));
+			service_update(s, stb, add);
+			avl_insert(&services, &s->avl);
+			service_touch(s);
+			blobmsg_add_string(&reply, NULL, s->name);
+		}
+	}
+	blobmsg_close_array(&reply, added);
+
+	service_batching = false;
+	if (batch_stopping)
+		uloop_timeout_set(&stop_timeout, SERVICE_STOP_TIMEOUT);
+	service_start_queue_run();
+
+	blobmsg_add_u64(&reply, "generation", service_generation);
+	service_notify("service.apply", reply.head);
+	ubus_send_reply(ctx, req, reply.head);
+
+	return 0;
+}
+
+static void
+service_dump(struct service *s, unsigned int fields, uint64_t since)
 {
 	struct service_instance *in;
 	void *c, *i;
@@ -233,13 +884,103 @@ service_dump(struct service *s, bool verbose)
 
 	if (!avl_is_empty(&s->instances.avl)) {
 		i = blobmsg_open_table(&b, "instances");
-		vlist_for_each_element(&s->instances, in, node)
-			instance_dump(&b, in, verbose);
+		vlist_for_each_element(&s->instances, in, node) {
+			if (in->generation > since)
+				instance_dump(&b, in, fields);
+		}
 		blobmsg_close_table(&b, i);
 	}
 	blobmsg_close_table(&b, c);
 }
 
+static void
+service_dump_removed(uint64_t since)
+{
+	unsigned int i;
+	void *c;
+
+	if (since < removed_floor) {
+		blobmsg_add_u8(&b, "reset", true);
+		return;
+	}
+
+	/* Oldest first, so services deleted and added again are handled right */
+	c = blobmsg_open_array(&b, "removed");
+	for (i = removed_next; i < removed_next + SERVICE_REMOVED_MAX; i++) {
+		unsigned int j = i % SERVICE_REMOVED_MAX;
+		void *e;
+
+		if (!removed[j].service || removed[j].generation <= since)
+			continue;
+
+		e = blobmsg_open_table(&b, NULL);
+		blobmsg_add_string(&b, "service", removed[j].service);
+		if (removed[j].instance)
+			blobmsg_add_string(&b, "instance", removed[j].instance);
+		blobmsg_close_table(&b, e);
+	}
+	blobmsg_close_array(&b, c);
+}
+
+static time_t
+service_list_cache_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static struct blob_attr *
+service_list_cached(struct blob_attr *msg)
+{
+	unsigned int i;
+
+	for (i = 0; i < SERVICE_LIST_CACHE_MAX; i++) {
+		if (!list_cache[i].msg ||
+		    list_cache[i].generation != service_generation ||
+		    !blob_attr_equal(list_cache[i].msg, msg))
+			continue;
+
+		if (list_cache[i].counters &&
+		    service_list_cache_now() - list_cache[i].time >= SERVICE_LIST_CACHE_TIME)
+			continue;
+
+		return list_cache[i].reply;
+	}
+
+	return NULL;
+}
+
+static void
+service_list_cache(struct blob_attr *msg, struct blob_attr *reply, bool counters)
+{
+	unsigned int i = list_cache_next++ % SERVICE_LIST_CACHE_MAX;
+
+	free(list_cache[i].msg);
+	free(list_cache[i].reply);
+
+	list_cache[i].msg = blob_memdup(msg);
+	list_cache[i].reply = blob_memdup(reply);
+	if (!list_cache[i].msg || !list_cache[i].reply) {
+		free(list_cache[i].msg);
+		free(list_cache[i].reply);
+		list_cache[i].msg = list_cache[i].reply = NULL;
+		return;
+	}
+
+	list_cache[i].generation = service_generation;
+	list_cache[i].counters = counters;
+	list_cache[i].time = service_list_cache_now();
+}
+
+/*
+ * With any of cursor, limit, fields or since given, the services are
+ * returned in a "services" table, together with the current generation
+ * and, if the reply is incomplete, the cursor to continue with. With
+ * since, only instances changed after that generation are included, and
+ * deleted services and instances are listed in "removed".
+ */
 static int
 service_handle_list(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
 		    struct ubus_request_data *req, UNUSED const char *method,
@@ -247,37 +988,100 @@ service_handle_list(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
 {
 	struct blob_attr *tb[__SERVICE_LIST_ATTR_MAX];
 	struct service *s;
-	const char *name = NULL;
-	bool verbose = false;
+	const char *name = NULL, *cursor = NULL, *last = NULL;
+	unsigned int fields = INSTANCE_DUMP_ALL;
+	uint32_t limit = 0, n = 0;
+	uint64_t since = 0;
+	struct blob_attr *reply;
+	bool paged;
+	void *c = NULL;
+
+	reply = service_list_cached(msg);
+	if (reply) {
+		ubus_send_reply(ctx, req, reply);
+		return 0;
+	}
 
 	blobmsg_parse(service_list_attrs, __SERVICE_LIST_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
 
-	if (tb[SERVICE_LIST_ATTR_VERBOSE])
-		verbose = blobmsg_get_bool(tb[SERVICE_LIST_ATTR_VERBOSE]);
 	if (tb[SERVICE_LIST_ATTR_NAME])
 		name = blobmsg_get_string(tb[SERVICE_LIST_ATTR_NAME]);
+	if (tb[SERVICE_LIST_ATTR_CURSOR])
+		cursor = blobmsg_get_string(tb[SERVICE_LIST_ATTR_CURSOR]);
+	if (tb[SERVICE_LIST_ATTR_LIMIT])
+		limit = blobmsg_get_u32(tb[SERVICE_LIST_ATTR_LIMIT]);
+	if (tb[SERVICE_LIST_ATTR_FIELDS])
+		fields = instance_dump_fields(tb[SERVICE_LIST_ATTR_FIELDS]);
+	if (tb[SERVICE_LIST_ATTR_SINCE])
+		since = blobmsg_get_u64(tb[SERVICE_LIST_ATTR_SINCE]);
+
+	paged = cursor || limit || tb[SERVICE_LIST_ATTR_FIELDS] || tb[SERVICE_LIST_ATTR_SINCE];
 
 	blob_buf_init(&b, 0);
-	avl_for_each_element(&services, s, avl) {
-		if (name && strcmp(s->name, name) != 0)
-			continue;
+	if (paged)
+		c = blobmsg_open_table(&b, "services");
+
+	if (name)
+		s = avl_find_element(&services, name, s, avl);
+	else if (cursor)
+		s = avl_find_ge_element(&services, cursor, s, avl);
+	else if (!avl_is_empty(&services))
+		s = avl_first_element(&services, s, avl);
+	else
+		s = NULL;
+
+	if (s && cursor && !strcmp(s->name, cursor))
+		s = avl_is_last(&services, &s->avl) ? NULL : avl_next_element(s, avl);
 
-		service_dump(s, verbose);
+	cursor = NULL;
+	if (s) {
+		avl_for_element_to_last(&services, s, s, avl) {
+			if (name && strcmp(s->name, name) != 0)
+				break;
+
+			if (s->generation <= since)
+				continue;
+
+			/* The cursor is the last service returned */
+			if (limit && n == limit) {
+				cursor = last;
+				break;
+			}
+
+			service_dump(s, fields, since);
+			last = s->name;
+			n++;
+		}
 	}
 
+	if (paged) {
+		blobmsg_close_table(&b, c);
+		blobmsg_add_u64(&b, "generation", service_generation);
+		if (cursor)
+			blobmsg_add_string(&b, "cursor", cursor);
+		if (tb[SERVICE_LIST_ATTR_SINCE])
+			service_dump_removed(since);
+	}
+
+	service_list_cache(msg, b.head, fields & (1U << INSTANCE_DUMP_LOG));
 	ubus_send_reply(ctx, req, b.head);
 
 	return 0;
 }
 
+/*
+ * With "wait", the reply is deferred until the processes of the deleted
+ * instances have exited, or the timeout has passed.
+ */
 static int
-service_handle_delete(UNUSED struct ubus_context *ctx, UNUSED struct ubus_object *obj,
-		      UNUSED struct ubus_request_data *req, UNUSED const char *method,
+service_handle_delete(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+		      struct ubus_request_data *req, UNUSED const char *method,
 		      struct blob_attr *msg)
 {
 	struct blob_attr *tb[__SERVICE_DEL_ATTR_MAX], *cur;
 	struct service *s;
-	struct service_instance *in;
+	struct service_instance *in = NULL;
+	bool wait;
 
 	blobmsg_parse(service_del_attrs, __SERVICE_DEL_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
 
@@ -290,18 +1094,22 @@ service_handle_delete(UNUSED struct ubus_context *ctx, UNUSED struct ubus_object
 		return UBUS_STATUS_NOT_FOUND;
 
 	cur = tb[SERVICE_DEL_ATTR_INSTANCE];
-	if (!cur) {
-		service_delete(s);
-		return 0;
+	if (cur) {
+		in = vlist_find(&s->instances, blobmsg_data(cur), in, node);
+		if (!in) {
+			ERROR("instance %s not found\n", (char *) blobmsg_data(cur));
+			return UBUS_STATUS_NOT_FOUND;
+		}
 	}
 
-	in = vlist_find(&s->instances, blobmsg_data(cur), in, node);
-	if (!in) {
-		ERROR("instance %s not found\n", (char *) blobmsg_data(cur));
-		return UBUS_STATUS_NOT_FOUND;
-	}
+	wait = tb[SERVICE_DEL_ATTR_WAIT] && blobmsg_get_bool(tb[SERVICE_DEL_ATTR_WAIT]);
+	if (wait)
+		wait_stopped(ctx, req, s, in, service_wait_timeout(tb[SERVICE_DEL_ATTR_TIMEOUT]));
 
-	vlist_delete(&s->instances, &in->node);
+	if (in)
+		vlist_delete(&s->instances, &in->node);
+	else
+		service_delete(s);
 
 	return 0;
 }
@@ -332,12 +1140,38 @@ service_handle_update(UNUSED struct ubus_context *ctx, UNUSED struct ubus_object
 	return 0;
 }
 
+static void
+service_dump_data(struct service *s, const char *instance)
+{
+	struct service_instance *in;
+	struct blobmsg_list_node *var;
+	void *cs = NULL, *ci;
+
+	vlist_for_each_element(&s->instances, in, node) {
+		if (instance && strcmp(instance, in->name))
+			continue;
+
+		if (blobmsg_list_empty(&in->data))
+			continue;
+
+		if (!cs)
+			cs = blobmsg_open_table(&b, s->name);
+
+		ci = blobmsg_open_table(&b, in->name);
+		blobmsg_list_for_each(&in->data, var)
+			blobmsg_add_blob(&b, var->data);
+		blobmsg_close_table(&b, ci);
+	}
+
+	if (cs)
+		blobmsg_close_table(&b, cs);
+}
+
 static int
 service_get_data(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
 		 struct ubus_request_data *req, UNUSED const char *method,
 		 struct blob_attr *msg)
 {
-	struct service_instance *in;
 	struct service *s;
 	struct blob_attr *tb[__DATA_MAX];
 	const char *name = NULL;
@@ -353,113 +1187,313 @@ service_get_data(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
 		type = blobmsg_data(tb[DATA_TYPE]);
 
 	blob_buf_init(&b, 0);
-	avl_for_each_element(&services, s, avl) {
-		void *cs = NULL;
 
-		if (name && strcmp(name, s->name))
-			continue;
+	if (type) {
+		data_dump_type(&b, name, instance, type);
+	} else if (name) {
+		s = avl_find_element(&services, name, s, avl);
+		if (s)
+			service_dump_data(s, instance);
+	} else {
+		avl_for_each_element(&services, s, avl)
+			service_dump_data(s, instance);
+	}
 
-		vlist_for_each_element(&s->instances, in, node) {
-			struct blobmsg_list_node *var;
-			void *ci = NULL;
+	ubus_send_reply(ctx, req, b.head);
+	return 0;
+}
 
-			if (instance && strcmp(instance, in->name))
-				continue;
+static int
+service_handle_pressure(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+			struct ubus_request_data *req, UNUSED const char *method,
+			UNUSED struct blob_attr *msg)
+{
+	struct service_instance *in;
+	struct service *s;
+	void *c, *cs;
 
-			blobmsg_list_for_each(&in->data, var) {
-				if (type &&
-				    strcmp(blobmsg_name(var->data), type))
-					continue;
+	blob_buf_init(&b, 0);
+	pressure_dump(&b);
 
-				if (!cs)
-					cs = blobmsg_open_table(&b, s->name);
-				if (!ci)
-					ci = blobmsg_open_table(&b, in->name);
+	c = blobmsg_open_table(&b, "instances");
+	avl_for_each_element(&services, s, avl) {
+		cs = NULL;
 
-				blobmsg_add_blob(&b, var->data);
-			}
+		vlist_for_each_element(&s->instances, in, node) {
+			void *ci;
 
-			if (ci)
-				blobmsg_close_table(&b, ci);
+			if (!in->pressure.action)
+				continue;
+
+			if (!cs)
+				cs = blobmsg_open_table(&b, s->name);
+
+			ci = blobmsg_open_table(&b, in->name);
+			blobmsg_add_u8(&b, "monitored", in->pressure.cgroup ? in->pressure.fd >= 0 : 1);
+			blobmsg_add_u32(&b, "events", in->pressure.events);
+			if (in->pressure.last.tv_sec)
+				blobmsg_add_u32(&b, "last", in->pressure.last.tv_sec);
+			blobmsg_close_table(&b, ci);
 		}
 
 		if (cs)
 			blobmsg_close_table(&b, cs);
 	}
+	blobmsg_close_table(&b, c);
 
 	ubus_send_reply(ctx, req, b.head);
 	return 0;
 }
 
+/* Passes a read-only fd of the status table, see status.h */
+static int
+service_handle_status(struct ubus_context *ctx, UNUSED struct ubus_object *obj,
+		      struct ubus_request_data *req, UNUSED const char *method,
+		      UNUSED struct blob_attr *msg)
+{
+	int fd = status_fd();
+
+	if (fd < 0)
+		return UBUS_STATUS_NOT_SUPPORTED;
+
+	ubus_request_set_fd(ctx, req, fd);
+
+	return 0;
+}
+
 static struct ubus_method main_object_methods[] = {
 	UBUS_METHOD("set", service_handle_set, service_set_attrs),
 	UBUS_METHOD("add", service_handle_set, service_set_attrs),
 	UBUS_METHOD("list", service_handle_list, service_list_attrs),
 	UBUS_METHOD("delete", service_handle_delete, service_del_attrs),
+	UBUS_METHOD("apply", service_handle_apply, service_apply_attrs),
+	UBUS_METHOD("diff", service_handle_diff, service_diff_attrs),
 	UBUS_METHOD("update_start", service_handle_update, service_attrs),
 	UBUS_METHOD("update_complete", service_handle_update, service_attrs),
 	UBUS_METHOD("get_data", service_get_data, get_data_policy),
+	UBUS_METHOD_NOARG("pressure", service_handle_pressure),
+	UBUS_METHOD_NOARG("status", service_handle_status),
 };
 
 static struct ubus_object_type main_object_type =
 	UBUS_OBJECT_TYPE("service", main_object_methods);
 
+static void
+service_subscribe_cb(UNUSED struct ubus_context *ctx, struct ubus_object *obj)
+{
+	if (obj->has_subscribers) {
+		service_notify_replay();
+		return;
+	}
+
+	uloop_timeout_cancel(&event_timeout);
+	service_event_flush(NULL);
+}
+
 static struct ubus_object main_object = {
 	.name = "service",
 	.type = &main_object_type,
 	.methods = main_object_methods,
 	.n_methods = ARRAY_SIZE(main_object_methods),
+	.subscribe_cb = service_subscribe_cb,
 };
 
-int
-service_start_early(char *name, char *cmdline)
+static void
+service_event_send(const char *type, const char *service, const char *instance)
+{
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "service", service);
+	if (instance)
+		blobmsg_add_string(&b, "instance", instance);
+	service_notify(type, b.head);
+}
+
+static void
+service_event_batch_send(struct event_batch *batch)
 {
-	void *instances, *instance, *command, *respawn;
-	char *t;
+	struct event *e;
+	void *c, *t;
+
+	if (batch->count == 1 && !batch->dropped) {
+		e = list_first_entry(&batch->events, struct event, list);
+		service_event_send(e->type, batch->avl.key, e->instance);
+		return;
+	}
 
 	blob_buf_init(&b, 0);
-	blobmsg_add_string(&b, "name", name);
-	instances = blobmsg_open_table(&b, "instances");
-	instance = blobmsg_open_table(&b, "instance1");
-	command = blobmsg_open_array(&b, "command");
-	t = strtok(cmdline, " ");
-	while (t) {
-		blobmsg_add_string(&b, NULL, t);
-		t = strtok(NULL, " ");
-	}
-	blobmsg_close_array(&b, command);
-	respawn = blobmsg_open_array(&b, "respawn");
-	blobmsg_add_string(&b, NULL, "3600");
-	blobmsg_add_string(&b, NULL, "1");
-	blobmsg_add_string(&b, NULL, "0");
-	blobmsg_close_array(&b, respawn);
-	blobmsg_close_table(&b, instance);
-	blobmsg_close_table(&b, instances);
-
-	return service_handle_set(NULL, NULL, NULL, "add", b.head);
+	blobmsg_add_string(&b, "service", batch->avl.key);
+	c = blobmsg_open_array(&b, "events");
+	list_for_each_entry(e, &batch->events, list) {
+		t = blobmsg_open_table(&b, NULL);
+		blobmsg_add_string(&b, "type", e->type);
+		if (e->instance)
+			blobmsg_add_string(&b, "instance", e->instance);
+		blobmsg_close_table(&b, t);
+	}
+	blobmsg_close_array(&b, c);
+	if (batch->dropped)
+		blobmsg_add_u32(&b, "dropped", batch->dropped);
+	service_notify("service.events", b.head);
+}
+
+static void
+service_event_flush(UNUSED struct uloop_timeout *t)
+{
+	struct event_batch *batch, *tmp;
+	struct event *e, *etmp;
+
+	avl_remove_all_elements(&event_batches, batch, avl, tmp) {
+		if (service_notify_wanted())
+			service_event_batch_send(batch);
+
+		list_for_each_entry_safe(e, etmp, &batch->events, list)
+			free(e);
+		free(batch);
+	}
 }
 
 void service_event(const char *type, const char *service, const char *instance)
 {
-	if (!ctx)
+	struct event_batch *batch;
+	struct event *e;
+	char *name, *instance_buf;
+
+	if (!service_notify_wanted() || service_batching)
+		return;
+
+	if (!event_window) {
+		service_event_send(type, service, instance);
+		return;
+	}
+
+	batch = avl_find_element(&event_batches, service, batch, avl);
+	if (!batch) {
+		batch = calloc_a(sizeof(*batch), &name, strlen(service) + 1);
+		if (!batch)
+			return;
+
+		batch->avl.key = strcpy(name, service);
+		INIT_LIST_HEAD(&batch->events);
+		avl_insert(&event_batches, &batch->avl);
+	}
+
+	if (batch->count >= SERVICE_EVENT_MAX) {
+		batch->dropped++;
+		return;
+	}
+
+	e = calloc_a(sizeof(*e), &instance_buf, instance ? strlen(instance) + 1 : 0);
+	if (!e)
+		return;
+
+	e->type = type;
+	if (instance)
+		e->instance = strcpy(instance_buf, instance);
+	list_add_tail(&e->list, &batch->events);
+	batch->count++;
+
+	if (!event_timeout.pending)
+		uloop_timeout_set(&event_timeout, event_window);
+}
+
+void service_event_pressure(const char *service, const char *instance, const char *action)
+{
+	if (!service_notify_wanted())
 		return;
 
 	blob_buf_init(&b, 0);
 	blobmsg_add_string(&b, "service", service);
-	if (instance)
-		blobmsg_add_string(&b, "instance", instance);
-	ubus_notify(ctx, &main_object, type, b.head, -1);
+	blobmsg_add_string(&b, "instance", instance);
+	blobmsg_add_string(&b, "action", action);
+	service_notify("instance.pressure", b.head);
+}
+
+static void
+service_event_removed(struct service *s, struct service_instance *in,
+		      uint64_t generation)
+{
+	if (!service_notify_wanted())
+		return;
+
+	blob_buf_init(&diff, 0);
+	blobmsg_add_u64(&diff, "generation", generation);
+	blobmsg_add_string(&diff, "service", s->name);
+	if (in)
+		blobmsg_add_string(&diff, "instance", in->name);
+	service_notify(in ? "instance.removed" : "service.removed", diff.head);
+}
+
+/* Compact state update for subscribers, sent whenever an instance changes */
+void service_event_state(struct service_instance *in)
+{
+	if (!service_notify_wanted())
+		return;
+
+	blob_buf_init(&diff, 0);
+	blobmsg_add_u64(&diff, "generation", in->generation);
+	blobmsg_add_string(&diff, "service", in->srv->name);
+	blobmsg_add_string(&diff, "instance", in->name);
+	blobmsg_add_u8(&diff, "running", in->proc.pending);
+	if (in->reloading)
+		blobmsg_add_u8(&diff, "reloading", true);
+	if (in->ready)
+		blobmsg_add_u8(&diff, "ready", true);
+	if (in->proc.pending)
+		blobmsg_add_u32(&diff, "pid", in->proc.pid);
+	service_notify("instance.state", diff.head);
+}
+
+struct service_instance *
+service_find_instance_by_pid(pid_t pid)
+{
+	struct service_instance *in;
+	struct service *s;
+
+	avl_for_each_element(&services, s, avl) {
+		vlist_for_each_element(&s->instances, in, node) {
+			if (in->proc.pending && in->proc.pid == pid)
+				return in;
+		}
+	}
+
+	return NULL;
 }
 
 void ubus_init_service(struct ubus_context *_ctx)
 {
 	ctx = _ctx;
+	connected = true;
 	ubus_add_object(ctx, &main_object);
+	journal_ubus_init(ctx);
+	service_notify_replay();
+}
+
+void ubus_disconnect_service(void)
+{
+	connected = false;
+}
+
+void ubus_reconnect_service(void)
+{
+	connected = true;
+	service_notify_replay();
 }
 
 void
 service_init(void)
 {
+	char line[16];
+
 	avl_init(&services, avl_strcmp, false, NULL);
+	avl_init(&event_batches, avl_strcmp, false, NULL);
+	data_init();
+	if (get_cmdline_val("unitd.event_window", line, sizeof(line)))
+		event_window = strtoul(line, NULL, 10);
+	pressure_init();
+	notify_init();
+	status_init();
+	control_init();
+	logger_init();
+	journal_init();
 }
 
@@ -21,8 +21,14 @@
 #include <libubox/vlist.h>
 #include <libubox/list.h>
 
+#include <sys/types.h>
+#include <stdint.h>
+
 extern struct avl_tree services;
 
+/* Incremented whenever any service or instance changes */
+extern uint64_t service_generation;
+
 struct vrule {
 	struct avl_node avl;
 	char *option;
@@ -35,8 +41,20 @@ struct service {
 
 	struct blob_attr *trigger;
 	struct vlist_tree instances;
+
+	/* Value of service_generation at the last change */
+	uint64_t generation;
 };
 
-int service_start_early(char *name, char *cmdline);
+struct service_instance;
+
 void service_init(void);
+void service_touch(struct service *s);
 void service_event(const char *type, const char *service, const char *instance);
+void service_event_pressure(const char *service, const char *instance, const char *action);
+void service_event_state(struct service_instance *in);
+bool service_start_deferred(struct service_instance *in);
+void service_restart_deferred(struct service_instance *in);
+void service_restart_exited(struct service_instance *in);
+void service_restart_cancel(struct service_instance *in);
+struct service_instance *service_find_instance_by_pid(pid_t pid);
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../unitd.h"
+#include "../status.h"
+
+#include "service.h"
+#include "instance.h"
+#include "status.h"
+
+
+static struct unitd_status *table;
+static int table_fd = -1;
+
+static unsigned int
+status_slot(struct service_instance *in)
+{
+	unsigned int i;
+
+	if (in->status_slot)
+		return in->status_slot - 1;
+
+	for (i = 0; i < UNITD_STATUS_ENTRIES; i++) {
+		if (!(table->entries[i].flags & UNITD_STATUS_USED))
+			break;
+	}
+
+	if (i == UNITD_STATUS_ENTRIES) {
+		if (!(table->flags & UNITD_STATUS_OVERFLOW))
+			WARN("Status table is full, %s::%s is not listed\n",
+			     in->srv->name, in->name);
+		table->flags |= UNITD_STATUS_OVERFLOW;
+		return UNITD_STATUS_ENTRIES;
+	}
+
+	in->status_slot = i + 1;
+	return i;
+}
+
+static void
+status_write(struct unitd_status_entry *e, struct service_instance *in)
+{
+	uint32_t seq = e->seq;
+
+	__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (in) {
+		e->flags = UNITD_STATUS_USED;
+		if (in->proc.pending)
+			e->flags |= UNITD_STATUS_RUNNING;
+		if (in->ready)
+			e->flags |= UNITD_STATUS_READY;
+		if (in->reloading)
+			e->flags |= UNITD_STATUS_RELOADING;
+		strncpy(e->service, in->srv->name, sizeof(e->service) - 1);
+		strncpy(e->instance, in->name, sizeof(e->instance) - 1);
+		e->pid = in->proc.pending ? in->proc.pid : 0;
+		e->restarts = in->restarts;
+		e->generation = in->generation;
+	} else {
+		memset((char *) e + sizeof(e->seq), 0, sizeof(*e) - sizeof(e->seq));
+	}
+
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+status_update(struct service_instance *in)
+{
+	unsigned int i;
+
+	if (!table)
+		return;
+
+	i = status_slot(in);
+	if (i < UNITD_STATUS_ENTRIES)
+		status_write(&table->entries[i], in);
+}
+
+void
+status_remove(struct service_instance *in)
+{
+	if (!table || !in->status_slot)
+		return;
+
+	status_write(&table->entries[in->status_slot - 1], NULL);
+	in->status_slot = 0;
+}
+
+/* Returns a new read-only fd for the table, to be passed to readers */
+int
+status_fd(void)
+{
+	char path[32];
+
+	if (table_fd < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", table_fd);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+void
+status_init(void)
+{
+	char path[32];
+	void *map;
+	int fd;
+
+	fd = memfd_create("unitd-status", MFD_CLOEXEC);
+	if (fd < 0) {
+		ERROR("Failed to create status table: %s\n", strerror(errno));
+		return;
+	}
+
+	if (ftruncate(fd, UNITD_STATUS_SIZE)) {
+		ERROR("Failed to create status table: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, UNITD_STATUS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ERROR("Failed to map status table: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	table = map;
+	table->n_entries = UNITD_STATUS_ENTRIES;
+	table->entry_size = sizeof(struct unitd_status_entry);
+	__atomic_store_n(&table->magic, UNITD_STATUS_MAGIC, __ATOMIC_RELEASE);
+	table_fd = fd;
+
+	/* The fd stays open, so root can open the table through /proc */
+	snprintf(path, sizeof(path), "/proc/1/fd/%d", fd);
+	mkdir("/run/unitd", 0755);
+	unlink(UNITD_STATUS_PATH);
+	if (symlink(path, UNITD_STATUS_PATH))
+		ERROR("Failed to link status table: %s\n", strerror(errno));
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../unitd.h"
+
+#include "uring.h"
+
+#ifdef __NR_io_uring_setup
+
+#include <linux/io_uring.h>
+
+#define URING_SQ_ENTRIES	256
+#define URING_CQ_ENTRIES	1024
+
+static struct {
+	int fd;
+	struct uloop_fd event;
+	void (*done)(void);
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local, sq_pending;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+} ring = { .fd = -1 };
+
+static int
+uring_enter(unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, 0, 0, NULL, 0);
+}
+
+void
+uring_submit(void)
+{
+	int ret;
+
+	if (!ring.sq_pending)
+		return;
+
+	__atomic_store_n(ring.sq_tail, ring.sq_local, __ATOMIC_RELEASE);
+
+	do {
+		ret = uring_enter(ring.sq_pending);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret > 0)
+		ring.sq_pending -= ret;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (ring.sq_local - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > *ring.sq_mask) {
+		uring_submit();
+		if (ring.sq_local - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > *ring.sq_mask)
+			return NULL;
+	}
+
+	idx = ring.sq_local & *ring.sq_mask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	ring.sq_local++;
+	ring.sq_pending++;
+
+	return sqe;
+}
+
+bool
+uring_read(struct uring_req *req, int fd, void *buf, size_t len)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = -1;
+	sqe->user_data = (uintptr_t) req;
+
+	return true;
+}
+
+void
+uring_cancel(struct uring_req *req)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) req;
+	sqe->user_data = 0;
+	uring_submit();
+}
+
+static void
+uring_event_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_req *req;
+	unsigned head, tail;
+	uint64_t val;
+
+	if (read(fd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		req = (struct uring_req *) (uintptr_t) cqe->user_data;
+		if (req)
+			req->cb(req, cqe->res);
+
+		head++;
+		if (head == tail) {
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+			tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+	if (ring.done)
+		ring.done();
+
+	uring_submit();
+}
+
+bool
+uring_available(void)
+{
+	return ring.fd >= 0;
+}
+
+bool
+uring_init(void (*done)(void))
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = URING_CQ_ENTRIES,
+	};
+	size_t sq_len, cq_len;
+	char *sq, *cq;
+	int efd;
+
+	ring.fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (ring.fd < 0) {
+		DEBUG(2, "io_uring not available: %s\n", strerror(errno));
+		return false;
+	}
+
+	/*
+	 * Without NODROP, completions could be lost when many reads finish at
+	 * once. Without FAST_POLL (5.7), every blocking pipe read would occupy
+	 * an io-wq worker thread; it also implies IORING_OP_READ (5.6).
+	 */
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_FAST_POLL))
+		goto err;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	cq = sq;
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto err_unmap;
+
+	ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.sq_local = *ring.sq_tail;
+
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0)
+		goto err_unmap_sqes;
+
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD, &efd, 1)) {
+		close(efd);
+		goto err_unmap_sqes;
+	}
+
+	ring.done = done;
+	ring.event.fd = efd;
+	ring.event.cb = uring_event_cb;
+	uloop_fd_add(&ring.event, ULOOP_READ);
+
+	return true;
+
+err_unmap_sqes:
+	munmap(ring.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+err_unmap:
+	munmap(sq, sq_len);
+err:
+	close(ring.fd);
+	ring.fd = -1;
+	return false;
+}
+
+#else
+
+bool
+uring_init(UNUSED void (*done)(void))
+{
+	return false;
+}
+
+bool
+uring_available(void)
+{
+	return false;
+}
+
+bool
+uring_read(UNUSED struct uring_req *req, UNUSED int fd, UNUSED void *buf, UNUSED size_t len)
+{
+	return false;
+}
+
+void
+uring_cancel(UNUSED struct uring_req *req)
+{
+}
+
+void
+uring_submit(void)
+{
+}
+
+#endif
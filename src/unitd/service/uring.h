@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Minimal io_uring wrapper. Completions are collected through an eventfd
+ * registered with uloop, so all requests finishing between two loop
+ * iterations are handled in a single wakeup.
+ */
+
+struct uring_req {
+	void (*cb)(struct uring_req *req, int res);
+};
+
+bool uring_init(void (*done)(void));
+bool uring_available(void);
+bool uring_read(struct uring_req *req, int fd, void *buf, size_t len);
+void uring_cancel(struct uring_req *req);
+void uring_submit(void);
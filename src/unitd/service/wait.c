@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../unitd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "wait.h"
+
+
+/*
+ * Requests deferred until the instances of a service are running or
+ * ready, or until the processes of deleted instances have exited.
+ * Deleted instances are freed right away, so their processes are
+ * tracked through pidfds instead.
+ */
+struct wait_pid {
+	struct uloop_fd fd;
+	struct wait *wait;
+};
+
+struct wait {
+	struct list_head list;
+	struct ubus_context *ctx;
+	struct ubus_request_data req;
+	struct uloop_timeout timeout;
+	enum wait_cond cond;
+	const char *service;
+
+	unsigned int n_pids;
+	unsigned int pending;
+	struct wait_pid *pids;
+};
+
+static LIST_HEAD(waits);
+
+static void
+wait_complete(struct wait *w, int ret)
+{
+	unsigned int i;
+
+	for (i = 0; i < w->n_pids; i++) {
+		if (w->pids[i].fd.fd < 0)
+			continue;
+
+		uloop_fd_delete(&w->pids[i].fd);
+		close(w->pids[i].fd.fd);
+	}
+
+	uloop_timeout_cancel(&w->timeout);
+	list_del(&w->list);
+	ubus_complete_deferred_request(w->ctx, &w->req, ret);
+	free(w);
+}
+
+static void
+wait_timeout(struct uloop_timeout *t)
+{
+	struct wait *w = container_of(t, struct wait, timeout);
+
+	wait_complete(w, UBUS_STATUS_TIMEOUT);
+}
+
+static void
+wait_pid_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	struct wait_pid *p = container_of(fd, struct wait_pid, fd);
+	struct wait *w = p->wait;
+
+	uloop_fd_delete(fd);
+	close(fd->fd);
+	fd->fd = -1;
+
+	if (!--w->pending)
+		wait_complete(w, 0);
+}
+
+/* Returns -1 while the condition is not met yet, a ubus status otherwise */
+static int
+wait_check(struct wait *w)
+{
+	struct service *s;
+	struct service_instance *in;
+
+	if (w->cond == WAIT_STOPPED)
+		return w->pending ? -1 : 0;
+
+	s = avl_find_element(&services, w->service, s, avl);
+	if (!s)
+		return UBUS_STATUS_NOT_FOUND;
+
+	vlist_for_each_element(&s->instances, in, node) {
+		/* These are never started */
+		if (!in->valid || !blobmsg_list_empty(&in->errors))
+			return UBUS_STATUS_UNKNOWN_ERROR;
+
+		if (!in->proc.pending)
+			return -1;
+		if (w->cond == WAIT_READY && !in->ready)
+			return -1;
+	}
+
+	return 0;
+}
+
+static struct wait *
+wait_alloc(struct ubus_context *ctx, struct ubus_request_data *req,
+	   struct service *s, enum wait_cond cond, unsigned int n_pids,
+	   uint32_t timeout)
+{
+	struct wait *w;
+	struct wait_pid *pids;
+	char *name;
+
+	w = calloc_a(sizeof(*w),
+		     &name, strlen(s->name) + 1,
+		     &pids, n_pids * sizeof(*pids));
+	if (!w)
+		return NULL;
+
+	w->ctx = ctx;
+	w->cond = cond;
+	w->service = strcpy(name, s->name);
+	w->pids = pids;
+	w->timeout.cb = wait_timeout;
+	list_add_tail(&w->list, &waits);
+
+	ubus_defer_request(ctx, req, &w->req);
+	uloop_timeout_set(&w->timeout, timeout * 1000);
+
+	return w;
+}
+
+void
+wait_instances(struct ubus_context *ctx, struct ubus_request_data *req,
+	       struct service *s, enum wait_cond cond, uint32_t timeout)
+{
+	struct wait *w;
+	int ret;
+
+	w = wait_alloc(ctx, req, s, cond, 0, timeout);
+	if (!w)
+		return;
+
+	ret = wait_check(w);
+	if (ret >= 0)
+		wait_complete(w, ret);
+}
+
+static int
+wait_pidfd(pid_t pid)
+{
+#ifdef __NR_pidfd_open
+	return syscall(__NR_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Must be called before the instances are deleted. Without pidfd
+ * support, the request is not deferred and completes like before.
+ */
+void
+wait_stopped(struct ubus_context *ctx, struct ubus_request_data *req,
+	     struct service *s, struct service_instance *in, uint32_t timeout)
+{
+	struct service_instance *cur;
+	struct wait *w;
+	unsigned int n = 0;
+	int fd;
+
+	vlist_for_each_element(&s->instances, cur, node) {
+		if ((!in || in == cur) && cur->proc.pending)
+			n++;
+	}
+
+	if (!n)
+		return;
+
+	w = wait_alloc(ctx, req, s, WAIT_STOPPED, n, timeout);
+	if (!w)
+		return;
+
+	vlist_for_each_element(&s->instances, cur, node) {
+		if ((in && in != cur) || !cur->proc.pending)
+			continue;
+
+		fd = wait_pidfd(cur->proc.pid);
+		if (fd < 0) {
+			DEBUG(2, "Failed to open pidfd for %s::%s\n", s->name, cur->name);
+			continue;
+		}
+
+		w->pids[w->n_pids].fd.fd = fd;
+		w->pids[w->n_pids].fd.cb = wait_pid_cb;
+		w->pids[w->n_pids].wait = w;
+		uloop_fd_add(&w->pids[w->n_pids].fd, ULOOP_READ);
+		w->n_pids++;
+		w->pending++;
+	}
+
+	if (!w->pending)
+		wait_complete(w, 0);
+}
+
+/* Called whenever the state of an instance changes */
+void
+wait_update(void)
+{
+	struct wait *w, *tmp;
+	int ret;
+
+	list_for_each_entry_safe(w, tmp, &waits, list) {
+		if (w->cond == WAIT_STOPPED)
+			continue;
+
+		ret = wait_check(w);
+		if (ret >= 0)
+			wait_complete(w, ret);
+	}
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <libubus.h>
+
+struct service;
+struct service_instance;
+
+/* Default time to wait for instances, in seconds */
+#define WAIT_TIMEOUT_DEFAULT 10
+
+enum wait_cond {
+	WAIT_RUNNING,
+	WAIT_READY,
+	WAIT_STOPPED,
+};
+
+void wait_instances(struct ubus_context *ctx, struct ubus_request_data *req,
+		    struct service *s, enum wait_cond cond, uint32_t timeout);
+void wait_stopped(struct ubus_context *ctx, struct ubus_request_data *req,
+		  struct service *s, struct service_instance *in, uint32_t timeout);
+void wait_update(void);
@@ -19,6 +19,7 @@
 #include "syslog.h"
 #include "utils.h"
 #include "service/service.h"
+#include "service/journal.h"
 
 #include <fcntl.h>
 #include <sys/reboot.h>
@@ -92,20 +93,20 @@ static void set_console(void)
 
 static void state_enter(void)
 {
-	char ubus_cmd[] = "/sbin/ubusd";
-
 	switch (state) {
 	case STATE_EARLY:
 		LOG("- early -\n");
 		unitd_early();
-		unitd_connect_ubus();
 		service_init();
-		service_start_early("ubus", ubus_cmd);
+		unitd_connect_ubus();
+
+		/* Units not depending on ubus start right away */
+		unitd_boot();
+		unitd_askconsole();
 		break;
 
 	case STATE_RUNNING:
 		LOG("- init -\n");
-		unitd_askconsole();
 
 		// switch to syslog log channel
 		ulog_open(ULOG_SYSLOG, LOG_DAEMON, "unitd");
@@ -126,6 +127,7 @@ static void state_enter(void)
 		sleep(1);
 		LOG("- SIGKILL processes -\n");
 		kill(-1, SIGKILL);
+		journal_flush();
 		sync();
 		sleep(1);
 		if (reboot_event == RB_POWER_OFF)
@@ -163,6 +165,8 @@ void unitd_state_next(void)
 
 void unitd_state_ubus_connect(void)
 {
+	unitd_boot_ubus_ready();
+
 	if (state == STATE_EARLY)
 		unitd_state_next();
 }
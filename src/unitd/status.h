@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2015 Matthias Schiffer <mschiffer@universe-factory.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Layout of the status table published by unitd, and helpers to read it.
+ *
+ * The table is a memfd mapped by unitd and linked as UNITD_STATUS_PATH;
+ * it can also be obtained as a read-only fd from the "status" method of
+ * the ubus service object. Each entry is protected by its own seqlock:
+ * the sequence number is odd while unitd updates the entry, and readers
+ * retry until they see the same even number before and after copying it.
+ *
+ * This header is self-contained, so it can be used outside of unitd.
+ */
+
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define UNITD_STATUS_PATH	"/run/unitd/status"
+#define UNITD_STATUS_MAGIC	0x75737431
+#define UNITD_STATUS_ENTRIES	512
+#define UNITD_STATUS_NAME_LEN	64
+
+/* Entry flags */
+#define UNITD_STATUS_USED	(1U << 0)
+#define UNITD_STATUS_RUNNING	(1U << 1)
+#define UNITD_STATUS_READY	(1U << 2)
+#define UNITD_STATUS_RELOADING	(1U << 3)
+
+/* Table flags */
+#define UNITD_STATUS_OVERFLOW	(1U << 0)
+
+struct unitd_status_entry {
+	uint32_t seq;
+	uint32_t flags;
+	char service[UNITD_STATUS_NAME_LEN];
+	char instance[UNITD_STATUS_NAME_LEN];
+	int32_t pid;
+	uint32_t restarts;
+	uint64_t generation;
+};
+
+struct unitd_status {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t n_entries;
+	uint32_t entry_size;
+	struct unitd_status_entry entries[];
+};
+
+#define UNITD_STATUS_SIZE \
+	(sizeof(struct unitd_status) + UNITD_STATUS_ENTRIES * sizeof(struct unitd_status_entry))
+
+/* Maps a status table fd; returns NULL on error */
+static inline const struct unitd_status *
+unitd_status_map(int fd)
+{
+	const struct unitd_status *st;
+	struct stat s;
+
+	if (fstat(fd, &s) || (size_t) s.st_size < sizeof(*st))
+		return NULL;
+
+	st = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (st == MAP_FAILED)
+		return NULL;
+
+	if (st->magic != UNITD_STATUS_MAGIC ||
+	    st->entry_size != sizeof(struct unitd_status_entry) ||
+	    sizeof(*st) + (size_t) st->n_entries * st->entry_size > (size_t) s.st_size) {
+		munmap((void *) st, s.st_size);
+		return NULL;
+	}
+
+	return st;
+}
+
+static inline const struct unitd_status *
+unitd_status_open(void)
+{
+	const struct unitd_status *st;
+	int fd;
+
+	fd = open(UNITD_STATUS_PATH, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	st = unitd_status_map(fd);
+	close(fd);
+
+	return st;
+}
+
+/* Copies entry i; returns false if the entry is unused */
+static inline bool
+unitd_status_read(const struct unitd_status *st, unsigned int i,
+		  struct unitd_status_entry *e)
+{
+	const struct unitd_status_entry *cur = &st->entries[i];
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&cur->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(e, cur, sizeof(*e));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&cur->seq, __ATOMIC_RELAXED) != seq);
+
+	e->service[UNITD_STATUS_NAME_LEN - 1] = 0;
+	e->instance[UNITD_STATUS_NAME_LEN - 1] = 0;
+
+	return e->flags & UNITD_STATUS_USED;
+}
+
+/* Looks up an instance by name; returns false if it is not found */
+static inline bool
+unitd_status_find(const struct unitd_status *st, const char *service,
+		  const char *instance, struct unitd_status_entry *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->n_entries; i++) {
+		if (!unitd_status_read(st, i, e))
+			continue;
+
+		if (!strcmp(e->service, service) && !strcmp(e->instance, instance))
+			return true;
+	}
+
+	return false;
+}
@@ -17,31 +17,135 @@
 
 #include "unitd.h"
 
+#include <sys/inotify.h>
 #include <sys/resource.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h>
+
+#ifndef UBUS_UNIX_SOCKET
+#define UBUS_UNIX_SOCKET "/var/run/ubus/ubus.sock"
+#endif
+
+/* Time for ubusd to start listening after its socket has appeared */
+#define UBUS_SOCKET_DELAY 20
 
 
 static struct ubus_context *ctx;
 static struct uloop_timeout ubus_timer;
+static bool connected;
+
+/*
+ * The directory of the ubus socket is watched, so a connection is made
+ * as soon as ubusd has created its socket. If the directory does not
+ * exist yet, its parent is watched for it to appear. The timers remain
+ * as a fallback.
+ */
+static struct uloop_fd ubus_watch = { .fd = -1 };
+static char ubus_dir[PATH_MAX];
+static const char *ubus_sock_name;
+static int ubus_dir_wd = -1;
 
 static void
 ubus_reconnect_cb(struct uloop_timeout *timeout)
 {
-	if (!ubus_reconnect(ctx, NULL))
+	if (!ubus_reconnect(ctx, NULL)) {
 		ubus_add_uloop(ctx);
-	else
+		connected = true;
+		ubus_reconnect_service();
+		DEBUG(2, "Reconnected to ubus, id=%08x\n", ctx->local_id);
+		unitd_state_ubus_connect();
+	} else {
 		uloop_timeout_set(timeout, 2000);
+	}
 }
 
 static void
 ubus_disconnect_cb(UNUSED struct ubus_context *ctx)
 {
+	connected = false;
+	ubus_disconnect_service();
 	ubus_timer.cb = ubus_reconnect_cb;
 	uloop_timeout_set(&ubus_timer, 2000);
 }
 
+static void
+ubus_socket_appeared(void)
+{
+	if (connected || !ubus_timer.cb)
+		return;
+
+	DEBUG(4, "ubus socket appeared\n");
+	uloop_timeout_set(&ubus_timer, UBUS_SOCKET_DELAY);
+}
+
+static void
+ubus_watch_dir(void)
+{
+	ubus_dir_wd = inotify_add_watch(ubus_watch.fd, ubus_dir, IN_CREATE | IN_MOVED_TO);
+	if (ubus_dir_wd >= 0 && !access(UBUS_UNIX_SOCKET, F_OK))
+		ubus_socket_appeared();
+}
+
+static void
+ubus_watch_cb(struct uloop_fd *fd, UNUSED unsigned int events)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (!ev->len)
+				continue;
+
+			if (ev->wd == ubus_dir_wd) {
+				if (!strcmp(ev->name, ubus_sock_name))
+					ubus_socket_appeared();
+			} else if (ubus_dir_wd < 0 && !strcmp(ev->name, strrchr(ubus_dir, '/') + 1)) {
+				ubus_watch_dir();
+			}
+		}
+	}
+}
+
+static void
+ubus_watch_init(void)
+{
+	char *p;
+
+	if (ubus_watch.fd >= 0)
+		return;
+
+	snprintf(ubus_dir, sizeof(ubus_dir), "%s", UBUS_UNIX_SOCKET);
+	p = strrchr(ubus_dir, '/');
+	if (!p || p == ubus_dir)
+		return;
+	*p = 0;
+	ubus_sock_name = UBUS_UNIX_SOCKET + (p - ubus_dir) + 1;
+
+	ubus_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ubus_watch.fd < 0)
+		return;
+
+	ubus_watch.cb = ubus_watch_cb;
+	uloop_fd_add(&ubus_watch, ULOOP_READ);
+
+	ubus_watch_dir();
+	if (ubus_dir_wd >= 0)
+		return;
+
+	/* Wait for the directory to be created */
+	p = strrchr(ubus_dir, '/');
+	*p = 0;
+	inotify_add_watch(ubus_watch.fd, p == ubus_dir ? "/" : ubus_dir, IN_CREATE | IN_MOVED_TO);
+	*p = '/';
+}
+
 static void
 ubus_connect_cb(UNUSED struct uloop_timeout *timeout)
 {
@@ -54,6 +158,7 @@ ubus_connect_cb(UNUSED struct uloop_timeout *timeout)
 	}
 
 	ctx->connection_lost = ubus_disconnect_cb;
+	connected = true;
 	ubus_init_service(ctx);
 	ubus_init_system(ctx);
 
@@ -66,5 +171,8 @@ void
 unitd_connect_ubus(void)
 {
 	ubus_timer.cb = ubus_connect_cb;
+	ubus_watch_init();
+	if (ubus_timer.pending)
+		return;
 	uloop_timeout_set(&ubus_timer, 1000);
 }
@@ -0,0 +1,317 @@
+/*
+  Copyright (c) 2015, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../log.h"
+#include "cache.h"
+#include "unit.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static const unitd_cache_unit_t * cache_units(const unitd_cache_header_t *cache) {
+	return (const unitd_cache_unit_t *)(cache + 1);
+}
+
+static const unitd_cache_dep_t * cache_deps(const unitd_cache_header_t *cache) {
+	return (const unitd_cache_dep_t *)(cache_units(cache) + cache->n_units);
+}
+
+static const uint32_t * cache_args(const unitd_cache_header_t *cache) {
+	return (const uint32_t *)(cache_deps(cache) + cache->n_deps);
+}
+
+static const char * cache_strings(const unitd_cache_header_t *cache) {
+	return (const char *)(cache_args(cache) + cache->n_args);
+}
+
+uint32_t unitd_cache_checksum(const void *data, size_t len) {
+	const uint8_t *p = data;
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+const unitd_cache_header_t * unitd_cache_map(const char *path, size_t *len) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(unitd_cache_header_t)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*len = st.st_size;
+	return map;
+}
+
+bool unitd_cache_valid(const unitd_cache_header_t *cache, size_t len) {
+	uint64_t size;
+	uint32_t i;
+
+	if (len < sizeof(*cache) || cache->magic != UNITD_CACHE_MAGIC ||
+	    cache->version != UNITD_CACHE_VERSION || cache->size != len)
+		return false;
+
+	size = sizeof(*cache) +
+		(uint64_t)cache->n_units * sizeof(unitd_cache_unit_t) +
+		(uint64_t)cache->n_deps * sizeof(unitd_cache_dep_t) +
+		(uint64_t)cache->n_args * sizeof(uint32_t) +
+		cache->strings_len;
+	if (size != len)
+		return false;
+
+	if (unitd_cache_checksum(cache + 1, len - sizeof(*cache)) != cache->checksum)
+		return false;
+
+	const char *strings = cache_strings(cache);
+	if (!cache->strings_len || strings[cache->strings_len - 1])
+		return false;
+
+	const unitd_cache_unit_t *units = cache_units(cache);
+	for (i = 0; i < cache->n_units; i++) {
+		if (units[i].name >= cache->strings_len ||
+		    units[i].type > UNIT_TYPE_TIMER ||
+		    units[i].service_type > SERVICE_TYPE_NOTIFY ||
+		    units[i].loaded > LOAD_STATE_LOADED ||
+		    (uint64_t)units[i].args + units[i].n_args > cache->n_args)
+			return false;
+
+		if (units[i].type == UNIT_TYPE_TIMER &&
+		    (units[i].unit >= cache->n_units ||
+		     (units[i].on_calendar != UNITD_CACHE_NO_STRING &&
+		      units[i].on_calendar >= cache->strings_len)))
+			return false;
+	}
+
+	const unitd_cache_dep_t *deps = cache_deps(cache);
+	for (i = 0; i < cache->n_deps; i++) {
+		if (deps[i].from >= cache->n_units || deps[i].to >= cache->n_units ||
+		    deps[i].type >= __CACHE_DEP_MAX ||
+		    (deps[i].owner != UNITD_CACHE_NO_OWNER && deps[i].owner >= cache->n_units))
+			return false;
+	}
+
+	const uint32_t *args = cache_args(cache);
+	for (i = 0; i < cache->n_args; i++) {
+		if (args[i] >= cache->strings_len)
+			return false;
+	}
+
+	return true;
+}
+
+bool unitd_cache_write(const char *path, const unitd_cache_header_t *cache) {
+	char tmp[PATH_MAX];
+	size_t done = 0;
+	ssize_t r;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	while (done < cache->size) {
+		r = write(fd, (const char *)cache + done, cache->size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+
+		done += r;
+	}
+
+	if (close(fd) || done < cache->size || rename(tmp, path)) {
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
+
+static void init_unit(unitd_unit_t *unit) {
+	INIT_LIST_HEAD(&unit->requires);
+	INIT_LIST_HEAD(&unit->required_by);
+	INIT_LIST_HEAD(&unit->wants);
+	INIT_LIST_HEAD(&unit->wanted_by);
+	INIT_LIST_HEAD(&unit->conflicts);
+	INIT_LIST_HEAD(&unit->conflicted_by);
+	INIT_LIST_HEAD(&unit->after);
+	INIT_LIST_HEAD(&unit->before);
+}
+
+void unitd_cache_link_dep(unitd_dep_t *dep, unitd_unit_t *from, unitd_unit_t *to, unitd_cache_dep_type_t type) {
+	dep->from = from;
+	dep->to = to;
+
+	switch (type) {
+	case CACHE_DEP_REQUIRES:
+		list_add_tail(&dep->list_from, &from->requires);
+		list_add_tail(&dep->list_to, &to->required_by);
+		break;
+
+	case CACHE_DEP_WANTS:
+		list_add_tail(&dep->list_from, &from->wants);
+		list_add_tail(&dep->list_to, &to->wanted_by);
+		break;
+
+	case CACHE_DEP_CONFLICTS:
+		list_add_tail(&dep->list_from, &from->conflicts);
+		list_add_tail(&dep->list_to, &to->conflicted_by);
+		break;
+
+	case CACHE_DEP_AFTER:
+		list_add_tail(&dep->list_from, &from->after);
+		list_add_tail(&dep->list_to, &to->before);
+		break;
+
+	default:
+		BUG("invalid dependency type");
+	}
+}
+
+static unitd_unit_file_t cache_file(const unitd_cache_unit_t *cunit) {
+	return (unitd_unit_file_t){
+		.dev = cunit->dev,
+		.ino = cunit->ino,
+		.size = cunit->size,
+		.mtime_sec = cunit->mtime.sec,
+		.mtime_nsec = cunit->mtime.nsec,
+	};
+}
+
+/**
+ * Creates the units of a validated cache and registers them
+ *
+ * Names and ExecStart arguments point into the cache, which must stay
+ * mapped. Units already registered by name, like the built-in ones,
+ * take precedence over units of the same name in the cache.
+ */
+int unitd_cache_instantiate(const unitd_cache_header_t *cache) {
+	const unitd_cache_unit_t *cunits = cache_units(cache);
+	const unitd_cache_dep_t *cdeps = cache_deps(cache);
+	const uint32_t *cargs = cache_args(cache);
+	const char *strings = cache_strings(cache);
+	unitd_cache_storage_t *storage;
+	unitd_unit_t **units;
+	unitd_dep_t *deps;
+	char **args;
+	uint32_t i, j;
+
+	storage = calloc(cache->n_units, sizeof(*storage));
+	units = calloc(cache->n_units, sizeof(*units));
+	deps = calloc(cache->n_deps, sizeof(*deps));
+	args = calloc(cache->n_args + cache->n_units, sizeof(*args));
+	if ((cache->n_units && (!storage || !units || !args)) || (cache->n_deps && !deps)) {
+		free(storage);
+		free(units);
+		free(deps);
+		free(args);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < cache->n_units; i++) {
+		const unitd_cache_unit_t *cunit = &cunits[i];
+		unitd_service_t *service = &storage[i].service;
+		unitd_timer_t *timer = &storage[i].timer;
+		unitd_unit_t *unit = &storage[i].unit;
+
+		units[i] = unitd_unit_find(strings + cunit->name);
+		if (units[i]) {
+			/* Only the dependencies from the unit file apply to built-in units */
+			units[i]->file = cache_file(cunit);
+			continue;
+		}
+
+		unit->type = cunit->type;
+		unit->loaded = cunit->loaded;
+		unit->name = (char *)strings + cunit->name;
+		unit->file = cache_file(cunit);
+		unit->state = UNIT_STATE_INACTIVE;
+		init_unit(unit);
+
+		if (unit->type == UNIT_TYPE_SERVICE) {
+			service->type = cunit->service_type;
+			service->ExecStart = args;
+			for (j = 0; j < cunit->n_args; j++)
+				*args++ = (char *)strings + cargs[cunit->args + j];
+			*args++ = NULL;
+		} else if (unit->type == UNIT_TYPE_TIMER) {
+			if (cunit->on_calendar != UNITD_CACHE_NO_STRING)
+				timer->OnCalendar = strings + cunit->on_calendar;
+			timer->OnBootSec = cunit->on_boot_sec;
+			timer->OnUnitActiveSec = cunit->on_unit_active_sec;
+			timer->RandomizedDelaySec = cunit->randomized_delay_sec;
+			timer->Persistent = cunit->persistent;
+		}
+
+		unitd_unit_register(unit);
+		units[i] = unit;
+	}
+
+	/* Timers can refer to units that come later in the cache */
+	for (i = 0; i < cache->n_units; i++) {
+		if (units[i] == &storage[i].unit && units[i]->type == UNIT_TYPE_TIMER)
+			storage[i].timer.Unit = units[cunits[i].unit];
+	}
+
+	for (i = 0; i < cache->n_deps; i++) {
+		if (cdeps[i].owner != UNITD_CACHE_NO_OWNER)
+			deps[i].owner = units[cdeps[i].owner];
+		unitd_cache_link_dep(&deps[i], units[cdeps[i].from], units[cdeps[i].to], cdeps[i].type);
+	}
+
+	free(units);
+
+	DEBUG(2, "Loaded %u units from cache\n", (unsigned)cache->n_units);
+
+	return 0;
+}
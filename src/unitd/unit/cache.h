@@ -0,0 +1,123 @@
+/*
+  Copyright (c) 2015, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "unit.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+  Binary unit cache
+
+  The cache is a single file consisting of a header followed by arrays of
+  units, dependencies and ExecStart arguments, and a string table. All
+  references are offsets or indices, so the file can be mapped and used
+  without any parsing. Each unit records the device, inode, size and mtime
+  of its unit file, so changed files can be found and reparsed one by one.
+  Dependencies record the unit whose file declares them, which allows
+  replacing the dependencies of a single unit.
+*/
+
+
+#define UNITD_CACHE_MAGIC	0x756e6331	/* "unc1" */
+#define UNITD_CACHE_VERSION	3
+#define UNITD_CACHE_NO_OWNER	UINT32_MAX
+#define UNITD_CACHE_NO_STRING	UINT32_MAX
+
+
+typedef enum unitd_cache_dep_type {
+	CACHE_DEP_REQUIRES,
+	CACHE_DEP_WANTS,
+	CACHE_DEP_CONFLICTS,
+	CACHE_DEP_AFTER,
+	__CACHE_DEP_MAX,
+} unitd_cache_dep_type_t;
+
+typedef struct unitd_cache_time {
+	int64_t sec;
+	int64_t nsec;
+} unitd_cache_time_t;
+
+typedef struct unitd_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/**< Size of the whole cache in bytes */
+	uint32_t checksum;		/**< FNV-1a hash of everything following the header */
+
+	uint32_t n_units;
+	uint32_t n_deps;
+	uint32_t n_args;
+	uint32_t strings_len;
+} unitd_cache_header_t;
+
+typedef struct unitd_cache_unit {
+	uint32_t name;			/**< Offset in the string table */
+	uint8_t type;			/**< unitd_unit_type_t */
+	uint8_t service_type;		/**< unitd_service_type_t */
+	uint8_t loaded;			/**< unitd_load_state_t */
+	uint8_t persistent;		/**< Timer Persistent= */
+	uint32_t args;			/**< Index of the first ExecStart argument */
+	uint32_t n_args;
+
+	uint32_t unit;			/**< Unit index of the unit a timer activates */
+	uint32_t on_calendar;		/**< Offset in the string table, or UNITD_CACHE_NO_STRING */
+	uint32_t on_boot_sec;
+	uint32_t on_unit_active_sec;
+	uint32_t randomized_delay_sec;
+	uint32_t reserved;
+
+	uint64_t dev;			/**< Unit file, all 0 if not loaded from a file */
+	uint64_t ino;
+	uint64_t size;
+	unitd_cache_time_t mtime;
+} unitd_cache_unit_t;
+
+typedef struct unitd_cache_dep {
+	uint32_t from;			/**< Unit index */
+	uint32_t to;			/**< Unit index */
+	uint32_t type;			/**< unitd_cache_dep_type_t */
+	uint32_t owner;			/**< Unit index, or UNITD_CACHE_NO_OWNER */
+} unitd_cache_dep_t;
+
+/* Followed by n_units units, n_deps deps, n_args string offsets and the strings */
+
+/* Units are allocated large enough for every type, so the type can change on reload */
+typedef union unitd_cache_storage {
+	unitd_unit_t unit;
+	unitd_service_t service;
+	unitd_timer_t timer;
+} unitd_cache_storage_t;
+
+
+uint32_t unitd_cache_checksum(const void *data, size_t len);
+const unitd_cache_header_t * unitd_cache_map(const char *path, size_t *len);
+bool unitd_cache_valid(const unitd_cache_header_t *cache, size_t len);
+bool unitd_cache_write(const char *path, const unitd_cache_header_t *cache);
+int unitd_cache_instantiate(const unitd_cache_header_t *cache);
+void unitd_cache_link_dep(unitd_dep_t *dep, unitd_unit_t *from, unitd_unit_t *to, unitd_cache_dep_type_t type);
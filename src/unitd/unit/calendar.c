@@ -0,0 +1,302 @@
+/*
+  Copyright (c) 2015, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "unit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+
+/* Upper bound for the search in unitd_calendar_next(); large enough to skip
+   over several years of non-matching months and days */
+#define CALENDAR_MAX_ITER 100000
+
+
+static const char *const weekdays[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+};
+
+static const struct {
+	const char *name;
+	const char *spec;
+} shorthands[] = {
+	{ "minutely", "*-*-* *:*:00" },
+	{ "hourly", "*-*-* *:00:00" },
+	{ "daily", "*-*-* 00:00:00" },
+	{ "weekly", "Mon *-*-* 00:00:00" },
+	{ "monthly", "*-*-01 00:00:00" },
+	{ "yearly", "*-01-01 00:00:00" },
+	{ "annually", "*-01-01 00:00:00" },
+};
+
+
+static inline uint64_t bit(unsigned n) {
+	return (uint64_t)1 << n;
+}
+
+static uint64_t range_mask(unsigned min, unsigned max) {
+	uint64_t mask = 0;
+	unsigned i;
+
+	for (i = min; i <= max; i++)
+		mask |= bit(i);
+
+	return mask;
+}
+
+static bool parse_value(const char **p, const char *end, unsigned *val) {
+	char *e;
+
+	if (*p == end || **p < '0' || **p > '9')
+		return false;
+
+	*val = strtoul(*p, &e, 10);
+	if (e > end)
+		return false;
+
+	*p = e;
+	return true;
+}
+
+static bool parse_weekday(const char **p, const char *end, unsigned *val) {
+	size_t len = end - *p;
+	unsigned i;
+
+	for (i = 0; i < 7; i++) {
+		if (len >= 3 && !strncasecmp(*p, weekdays[i], 3)) {
+			*p += 3;
+			/* Allow long weekday names like "Monday" */
+			while (*p < end && ((**p >= 'a' && **p <= 'z') || (**p >= 'A' && **p <= 'Z')))
+				(*p)++;
+
+			*val = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Parses a comma-separated list of values, ranges (a..b) and repetitions
+ * (a/n, a..b/n, * / n) into a bitmask.
+ */
+static bool parse_field(const char *p, const char *end, unsigned min, unsigned max,
+			bool weekday, uint64_t *mask) {
+	*mask = 0;
+
+	while (p < end) {
+		unsigned first, last, step = 1, i;
+
+		if (*p == '*') {
+			first = min;
+			last = max;
+			p++;
+		} else {
+			if (weekday ? !parse_weekday(&p, end, &first) : !parse_value(&p, end, &first))
+				return false;
+
+			last = first;
+
+			if (end - p >= 2 && p[0] == '.' && p[1] == '.') {
+				p += 2;
+				if (weekday ? !parse_weekday(&p, end, &last) : !parse_value(&p, end, &last))
+					return false;
+			} else if (p < end && *p == '/') {
+				last = max;
+			}
+		}
+
+		if (p < end && *p == '/') {
+			p++;
+			if (!parse_value(&p, end, &step) || !step)
+				return false;
+		}
+
+		if (first < min || last > max || first > last)
+			return false;
+
+		for (i = first; i <= last; i += step)
+			*mask |= bit(i);
+
+		if (p == end)
+			break;
+		if (*p != ',')
+			return false;
+		p++;
+	}
+
+	return *mask != 0;
+}
+
+static bool parse_date(unitd_calendar_t *cal, const char *p, const char *end) {
+	const char *sep1 = memchr(p, '-', end - p), *sep2;
+	uint64_t mask;
+
+	if (!sep1)
+		return false;
+
+	sep2 = memchr(sep1 + 1, '-', end - sep1 - 1);
+	if (sep2) {
+		/* Only wildcard years are supported */
+		if (sep1 - p != 1 || *p != '*')
+			return false;
+
+		p = sep1 + 1;
+		sep1 = sep2;
+	}
+
+	if (!parse_field(p, sep1, 1, 12, false, &mask))
+		return false;
+	cal->month = mask;
+
+	if (!parse_field(sep1 + 1, end, 1, 31, false, &mask))
+		return false;
+	cal->mday = mask;
+
+	return true;
+}
+
+static bool parse_time(unitd_calendar_t *cal, const char *p, const char *end) {
+	const char *sep1 = memchr(p, ':', end - p), *sep2;
+	uint64_t mask;
+
+	if (!sep1)
+		return false;
+
+	if (!parse_field(p, sep1, 0, 23, false, &mask))
+		return false;
+	cal->hour = mask;
+
+	sep2 = memchr(sep1 + 1, ':', end - sep1 - 1);
+	if (!sep2)
+		sep2 = end;
+
+	if (!parse_field(sep1 + 1, sep2, 0, 59, false, &cal->minute))
+		return false;
+
+	if (sep2 == end)
+		cal->second = bit(0);
+	else if (!parse_field(sep2 + 1, end, 0, 59, false, &cal->second))
+		return false;
+
+	return true;
+}
+
+/**
+ * Parses a calendar specification of the form
+ * "[Weekdays] [*-Month-Day] [Hour:Minute[:Second]]" or one of the shorthands
+ * "minutely", "hourly", "daily", "weekly", "monthly" and "yearly".
+ *
+ * A missing date matches every day, a missing time means midnight.
+ */
+bool unitd_calendar_parse(unitd_calendar_t *cal, const char *spec) {
+	const char *p = spec, *end;
+	unsigned i;
+	uint64_t mask;
+
+	for (i = 0; i < sizeof(shorthands)/sizeof(shorthands[0]); i++) {
+		if (!strcasecmp(spec, shorthands[i].name)) {
+			spec = shorthands[i].spec;
+			p = spec;
+			break;
+		}
+	}
+
+	cal->second = bit(0);
+	cal->minute = bit(0);
+	cal->hour = bit(0);
+	cal->mday = range_mask(1, 31);
+	cal->month = range_mask(1, 12);
+	cal->wday = range_mask(0, 6);
+
+	while (*p) {
+		while (*p == ' ')
+			p++;
+		if (!*p)
+			break;
+
+		end = p + strcspn(p, " ");
+
+		if (memchr(p, ':', end - p)) {
+			if (!parse_time(cal, p, end))
+				return false;
+		} else if (memchr(p, '-', end - p)) {
+			if (!parse_date(cal, p, end))
+				return false;
+		} else {
+			if (!parse_field(p, end, 0, 6, true, &mask))
+				return false;
+			cal->wday = mask;
+		}
+
+		p = end;
+	}
+
+	return true;
+}
+
+/**
+ * Determines the first point in time (local time) strictly after \e after
+ * matching the calendar specification.
+ */
+bool unitd_calendar_next(const unitd_calendar_t *cal, time_t after, time_t *next) {
+	struct tm tm;
+	time_t t = after + 1;
+	unsigned i;
+
+	if (!localtime_r(&t, &tm))
+		return false;
+
+	for (i = 0; i < CALENDAR_MAX_ITER; i++) {
+		if (!(cal->month & bit(tm.tm_mon + 1))) {
+			tm.tm_mon++;
+			tm.tm_mday = 1;
+			tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		} else if (!(cal->mday & bit(tm.tm_mday)) || !(cal->wday & bit(tm.tm_wday))) {
+			tm.tm_mday++;
+			tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		} else if (!(cal->hour & bit(tm.tm_hour))) {
+			tm.tm_hour++;
+			tm.tm_min = tm.tm_sec = 0;
+		} else if (!(cal->minute & bit(tm.tm_min))) {
+			tm.tm_min++;
+			tm.tm_sec = 0;
+		} else if (!(cal->second & bit(tm.tm_sec))) {
+			tm.tm_sec++;
+		} else {
+			*next = t;
+			return true;
+		}
+
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+		if (t == (time_t)-1 || !localtime_r(&t, &tm))
+			return false;
+	}
+
+	return false;
+}
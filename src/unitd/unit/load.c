@@ -0,0 +1,1088 @@
+/*
+  Copyright (c) 2015, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../log.h"
+#include "cache.h"
+#include "unit.h"
+
+#include <libubox/avl-cmp.h>
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Earlier directories take precedence for units of the same name */
+static const char *const unit_dirs[] = {
+	"/etc/unitd/system",
+	"/lib/unitd/system",
+};
+
+/* Tried in order, the first writable location is used */
+static const char *const cache_paths[] = {
+	"/etc/unitd/units.cache",
+	"/run/unitd/units.cache",
+};
+
+/* Delay between a change in a unit directory and the reload */
+#define RELOAD_DELAY 200
+
+
+static struct avl_tree units = AVL_TREE_INIT(units, avl_strcmp, false, NULL);
+
+unitd_unit_t * unitd_unit_find(const char *name) {
+	unitd_unit_t *unit;
+
+	return avl_find_element(&units, name, unit, node);
+}
+
+void unitd_unit_register(unitd_unit_t *unit) {
+	unit->node.key = unit->name;
+	avl_insert(&units, &unit->node);
+}
+
+
+/*
+  Builder
+
+  Unit files are parsed into the same representation that is used for the
+  binary cache. When a unit file is reloaded, the result is applied to the
+  registered units; when the cache is written, the builder is filled from
+  the registered units.
+*/
+
+typedef struct builder_name {
+	struct avl_node node;
+	uint32_t index;
+} builder_name_t;
+
+typedef struct builder {
+	struct avl_tree names;
+
+	unitd_cache_unit_t *units;
+	uint32_t n_units, units_size;
+
+	unitd_cache_dep_t *deps;
+	uint32_t n_deps, deps_size;
+
+	uint32_t *args;
+	uint32_t n_args, args_size;
+
+	char *strings;
+	uint32_t strings_len, strings_size;
+
+	bool failed;
+} builder_t;
+
+
+static void builder_init(builder_t *b) {
+	*b = (builder_t){};
+	avl_init(&b->names, avl_strcmp, false, NULL);
+}
+
+static void builder_free(builder_t *b) {
+	builder_name_t *entry, *tmp;
+
+	avl_remove_all_elements(&b->names, entry, node, tmp)
+		free(entry);
+	free(b->units);
+	free(b->deps);
+	free(b->args);
+	free(b->strings);
+}
+
+static bool grow(void **array, uint32_t *size, uint32_t n, size_t elem) {
+	uint32_t new_size;
+	void *p;
+
+	if (n < *size)
+		return true;
+
+	new_size = *size ? 2 * *size : 64;
+	p = realloc(*array, new_size * elem);
+	if (!p)
+		return false;
+
+	*array = p;
+	*size = new_size;
+	return true;
+}
+
+static uint32_t add_string(builder_t *b, const char *s, size_t len) {
+	uint32_t ret = b->strings_len;
+
+	while (b->strings_len + len + 1 > b->strings_size) {
+		if (!grow((void **)&b->strings, &b->strings_size, b->strings_size, 1)) {
+			b->failed = true;
+			return 0;
+		}
+	}
+
+	memcpy(b->strings + b->strings_len, s, len);
+	b->strings[b->strings_len + len] = 0;
+	b->strings_len += len + 1;
+
+	return ret;
+}
+
+/* Returns the index of the named unit, adding a placeholder if necessary */
+static uint32_t get_unit(builder_t *b, const char *name, size_t len) {
+	builder_name_t *entry;
+	char *key;
+
+	char buf[len + 1];
+	memcpy(buf, name, len);
+	buf[len] = 0;
+
+	entry = avl_find_element(&b->names, buf, entry, node);
+	if (entry)
+		return entry->index;
+
+	if (!grow((void **)&b->units, &b->units_size, b->n_units, sizeof(*b->units))) {
+		b->failed = true;
+		return 0;
+	}
+
+	entry = calloc_a(sizeof(*entry), &key, len + 1);
+	if (!entry) {
+		b->failed = true;
+		return 0;
+	}
+
+	entry->node.key = strcpy(key, buf);
+	entry->index = b->n_units++;
+	avl_insert(&b->names, &entry->node);
+
+	b->units[entry->index] = (unitd_cache_unit_t){
+		.name = add_string(b, name, len),
+		.type = UNIT_TYPE_TARGET,
+		.loaded = LOAD_STATE_NOT_FOUND,
+		.on_calendar = UNITD_CACHE_NO_STRING,
+	};
+
+	return entry->index;
+}
+
+static void add_dep(builder_t *b, uint32_t from, uint32_t to, unitd_cache_dep_type_t type, uint32_t owner) {
+	if (!grow((void **)&b->deps, &b->deps_size, b->n_deps, sizeof(*b->deps))) {
+		b->failed = true;
+		return;
+	}
+
+	b->deps[b->n_deps++] = (unitd_cache_dep_t){
+		.from = from,
+		.to = to,
+		.type = type,
+		.owner = owner,
+	};
+}
+
+static void add_arg(builder_t *b, const char *s, size_t len) {
+	if (!grow((void **)&b->args, &b->args_size, b->n_args, sizeof(*b->args))) {
+		b->failed = true;
+		return;
+	}
+
+	b->args[b->n_args++] = add_string(b, s, len);
+}
+
+
+/* Unit file parser */
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void trim(const char **start, const char **end) {
+	while (*start < *end && is_space(**start))
+		(*start)++;
+	while (*end > *start && is_space((*end)[-1]))
+		(*end)--;
+}
+
+static bool key_is(const char *key, size_t len, const char *name) {
+	return strlen(name) == len && !memcmp(key, name, len);
+}
+
+/* Splits a space-separated list of unit names */
+static void parse_deps(builder_t *b, uint32_t unit, const char *value, const char *end,
+		       unitd_cache_dep_type_t type, bool reverse) {
+	const char *p = value, *word;
+
+	while (p < end) {
+		while (p < end && is_space(*p))
+			p++;
+
+		word = p;
+		while (p < end && !is_space(*p))
+			p++;
+
+		if (p == word)
+			break;
+
+		uint32_t other = get_unit(b, word, p - word);
+		if (reverse)
+			add_dep(b, other, unit, type, unit);
+		else
+			add_dep(b, unit, other, type, unit);
+	}
+}
+
+static bool parse_exec(builder_t *b, unitd_cache_unit_t *unit, const char *value, const char *end) {
+	const char *p = value, *word;
+
+	if (unit->n_args) {
+		WARN("Unit %s: ExecStart given more than once\n", b->strings + unit->name);
+		return false;
+	}
+
+	unit->args = b->n_args;
+
+	while (p < end) {
+		while (p < end && is_space(*p))
+			p++;
+
+		word = p;
+		while (p < end && !is_space(*p))
+			p++;
+
+		if (p == word)
+			break;
+
+		add_arg(b, word, p - word);
+		unit->n_args++;
+	}
+
+	if (!unit->n_args || b->strings[b->args[unit->args]] != '/') {
+		WARN("Unit %s: ExecStart must be an absolute path\n", b->strings + unit->name);
+		return false;
+	}
+
+	return true;
+}
+
+static bool parse_service_type(unitd_cache_unit_t *unit, const char *value, size_t len) {
+	if (key_is(value, len, "simple"))
+		unit->service_type = SERVICE_TYPE_SIMPLE;
+	else if (key_is(value, len, "forking"))
+		unit->service_type = SERVICE_TYPE_FORKING;
+	else if (key_is(value, len, "oneshot"))
+		unit->service_type = SERVICE_TYPE_ONESHOT;
+	else if (key_is(value, len, "notify"))
+		unit->service_type = SERVICE_TYPE_NOTIFY;
+	else
+		return false;
+
+	return true;
+}
+
+/* Parses a time span in seconds, optionally with a unit suffix */
+static bool parse_sec(const char *value, const char *end, uint32_t *ret) {
+	const char *p = value;
+	uint64_t v = 0, mult;
+
+	while (p < end && *p >= '0' && *p <= '9') {
+		v = 10 * v + (*p++ - '0');
+		if (v > UINT32_MAX)
+			return false;
+	}
+
+	if (p == value)
+		return false;
+
+	if (p == end || key_is(p, end - p, "s"))
+		mult = 1;
+	else if (key_is(p, end - p, "min"))
+		mult = 60;
+	else if (key_is(p, end - p, "h"))
+		mult = 3600;
+	else if (key_is(p, end - p, "d"))
+		mult = 86400;
+	else
+		return false;
+
+	if (v * mult > UINT32_MAX)
+		return false;
+
+	*ret = v * mult;
+	return true;
+}
+
+static bool parse_bool(const char *value, size_t len, uint8_t *ret) {
+	if (key_is(value, len, "yes") || key_is(value, len, "true") ||
+	    key_is(value, len, "on") || key_is(value, len, "1"))
+		*ret = true;
+	else if (key_is(value, len, "no") || key_is(value, len, "false") ||
+		 key_is(value, len, "off") || key_is(value, len, "0"))
+		*ret = false;
+	else
+		return false;
+
+	return true;
+}
+
+static bool parse_timer(builder_t *b, uint32_t index, const char *key, size_t key_len,
+			const char *value, const char *end) {
+	unitd_cache_unit_t *unit = &b->units[index];
+
+	if (key_is(key, key_len, "OnCalendar")) {
+		unit->on_calendar = add_string(b, value, end - value);
+	} else if (key_is(key, key_len, "OnBootSec")) {
+		return parse_sec(value, end, &unit->on_boot_sec);
+	} else if (key_is(key, key_len, "OnUnitActiveSec")) {
+		return parse_sec(value, end, &unit->on_unit_active_sec);
+	} else if (key_is(key, key_len, "RandomizedDelaySec")) {
+		return parse_sec(value, end, &unit->randomized_delay_sec);
+	} else if (key_is(key, key_len, "Persistent")) {
+		return parse_bool(value, end - value, &unit->persistent);
+	} else if (key_is(key, key_len, "Unit")) {
+		if (value == end)
+			return false;
+
+		/* get_unit() may move the unit array */
+		uint32_t other = get_unit(b, value, end - value);
+		b->units[index].unit = other;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+static bool parse_line(builder_t *b, uint32_t index, const char *section, size_t section_len,
+		       const char *key, size_t key_len, const char *value, const char *end) {
+	unitd_cache_unit_t *unit = &b->units[index];
+
+	if (key_is(section, section_len, "Unit")) {
+		if (key_is(key, key_len, "Description"))
+			return true;
+		if (key_is(key, key_len, "Requires"))
+			parse_deps(b, index, value, end, CACHE_DEP_REQUIRES, false);
+		else if (key_is(key, key_len, "Wants"))
+			parse_deps(b, index, value, end, CACHE_DEP_WANTS, false);
+		else if (key_is(key, key_len, "Conflicts"))
+			parse_deps(b, index, value, end, CACHE_DEP_CONFLICTS, false);
+		else if (key_is(key, key_len, "After"))
+			parse_deps(b, index, value, end, CACHE_DEP_AFTER, false);
+		else if (key_is(key, key_len, "Before"))
+			parse_deps(b, index, value, end, CACHE_DEP_AFTER, true);
+		else
+			return false;
+	} else if (key_is(section, section_len, "Install")) {
+		if (key_is(key, key_len, "WantedBy"))
+			parse_deps(b, index, value, end, CACHE_DEP_WANTS, true);
+		else if (key_is(key, key_len, "RequiredBy"))
+			parse_deps(b, index, value, end, CACHE_DEP_REQUIRES, true);
+		else
+			return false;
+	} else if (key_is(section, section_len, "Timer") && unit->type == UNIT_TYPE_TIMER) {
+		return parse_timer(b, index, key, key_len, value, end);
+	} else if (key_is(section, section_len, "Service") && unit->type == UNIT_TYPE_SERVICE) {
+		if (key_is(key, key_len, "Type"))
+			return parse_service_type(unit, value, end - value);
+		else if (key_is(key, key_len, "ExecStart"))
+			return parse_exec(b, unit, value, end);
+		else
+			return false;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Parses a single unit file
+ *
+ * The unit itself always gets index 0 in the builder, the units it
+ * references follow as placeholders.
+ */
+static bool parse_file(builder_t *b, int dirfd, const char *name, unitd_unit_type_t type) {
+	const char *data, *p, *end, *line, *eol, *section = NULL, *eq;
+	size_t section_len = 0;
+	unsigned lineno = 0;
+	struct stat st;
+	uint32_t index;
+	bool valid = true;
+	int fd;
+
+	index = get_unit(b, name, strlen(name));
+	if (b->failed)
+		return false;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	if (!st.st_size) {
+		data = "";
+	} else {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+
+	b->units[index].type = type;
+	b->units[index].service_type = SERVICE_TYPE_SIMPLE;
+
+	/* Timers activate the service of the same name unless Unit= is given */
+	if (type == UNIT_TYPE_TIMER) {
+		size_t base_len = strlen(name) - strlen(".timer");
+		char service[base_len + sizeof(".service")];
+
+		memcpy(service, name, base_len);
+		strcpy(service + base_len, ".service");
+		uint32_t other = get_unit(b, service, strlen(service));
+		b->units[index].unit = other;
+	}
+
+	end = data + st.st_size;
+	for (p = data; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		lineno++;
+		line = p;
+		const char *line_end = eol;
+		trim(&line, &line_end);
+
+		if (line == line_end || *line == '#' || *line == ';')
+			continue;
+
+		if (*line == '[') {
+			if (line_end[-1] != ']') {
+				WARN("%s:%u: invalid section header\n", name, lineno);
+				valid = false;
+				break;
+			}
+
+			section = line + 1;
+			section_len = line_end - line - 2;
+			continue;
+		}
+
+		eq = memchr(line, '=', line_end - line);
+		if (!eq || !section) {
+			WARN("%s:%u: invalid line\n", name, lineno);
+			valid = false;
+			break;
+		}
+
+		const char *key = line, *key_end = eq, *value = eq + 1, *value_end = line_end;
+		trim(&key, &key_end);
+		trim(&value, &value_end);
+
+		if (!parse_line(b, index, section, section_len, key, key_end - key, value, value_end)) {
+			WARN("%s:%u: invalid or unsupported setting\n", name, lineno);
+			valid = false;
+			break;
+		}
+	}
+
+	if (type == UNIT_TYPE_SERVICE && !b->units[index].n_args) {
+		WARN("Unit %s has no ExecStart\n", name);
+		valid = false;
+	}
+
+	if (type == UNIT_TYPE_TIMER && b->units[index].on_calendar == UNITD_CACHE_NO_STRING &&
+	    !b->units[index].on_boot_sec && !b->units[index].on_unit_active_sec) {
+		WARN("Timer %s has no trigger\n", name);
+		valid = false;
+	}
+
+	if (st.st_size)
+		munmap((void *)data, st.st_size);
+
+	/* Dependencies added by an invalid unit are kept, but it is never started */
+	if (valid)
+		b->units[index].loaded = LOAD_STATE_LOADED;
+
+	return true;
+}
+
+static bool unit_file_type(const char *name, unitd_unit_type_t *type) {
+	const char *ext = strrchr(name, '.');
+
+	if (!ext)
+		return false;
+
+	if (!strcmp(ext, ".service"))
+		*type = UNIT_TYPE_SERVICE;
+	else if (!strcmp(ext, ".target"))
+		*type = UNIT_TYPE_TARGET;
+	else if (!strcmp(ext, ".timer"))
+		*type = UNIT_TYPE_TIMER;
+	else
+		return false;
+
+	return true;
+}
+
+
+/* Cache compiler */
+
+static void compile_deps(builder_t *b, struct list_head *head, unitd_cache_dep_type_t type) {
+	unitd_dep_t *dep;
+
+	list_for_each_entry(dep, head, list_from) {
+		/* Built-in dependencies are not part of any unit file */
+		if (!dep->owner)
+			continue;
+
+		add_dep(b,
+			get_unit(b, dep->from->name, strlen(dep->from->name)),
+			get_unit(b, dep->to->name, strlen(dep->to->name)),
+			type,
+			get_unit(b, dep->owner->name, strlen(dep->owner->name)));
+	}
+}
+
+static unitd_cache_header_t * compile(void) {
+	unitd_cache_header_t *cache = NULL;
+	unitd_unit_t *unit;
+	builder_t b;
+	size_t i;
+
+	builder_init(&b);
+
+	avl_for_each_element(&units, unit, node) {
+		uint32_t index = get_unit(&b, unit->name, strlen(unit->name));
+		if (b.failed)
+			break;
+
+		unitd_cache_unit_t *cunit = &b.units[index];
+		cunit->type = unit->type;
+		cunit->loaded = unit->loaded;
+		cunit->dev = unit->file.dev;
+		cunit->ino = unit->file.ino;
+		cunit->size = unit->file.size;
+		cunit->mtime.sec = unit->file.mtime_sec;
+		cunit->mtime.nsec = unit->file.mtime_nsec;
+
+		if (unit->type == UNIT_TYPE_TIMER) {
+			unitd_timer_t *timer = container_of(unit, unitd_timer_t, unit);
+			uint32_t other = get_unit(&b, timer->Unit->name, strlen(timer->Unit->name));
+			uint32_t on_calendar = UNITD_CACHE_NO_STRING;
+
+			if (timer->OnCalendar)
+				on_calendar = add_string(&b, timer->OnCalendar, strlen(timer->OnCalendar));
+
+			/* get_unit() may have moved the unit array */
+			cunit = &b.units[index];
+			cunit->unit = other;
+			cunit->on_calendar = on_calendar;
+			cunit->on_boot_sec = timer->OnBootSec;
+			cunit->on_unit_active_sec = timer->OnUnitActiveSec;
+			cunit->randomized_delay_sec = timer->RandomizedDelaySec;
+			cunit->persistent = timer->Persistent;
+			continue;
+		}
+
+		if (unit->type != UNIT_TYPE_SERVICE)
+			continue;
+
+		unitd_service_t *service = container_of(unit, unitd_service_t, unit);
+		cunit->service_type = service->type;
+		cunit->args = b.n_args;
+		for (i = 0; service->ExecStart[i]; i++)
+			add_arg(&b, service->ExecStart[i], strlen(service->ExecStart[i]));
+		cunit->n_args = i;
+	}
+
+	avl_for_each_element(&units, unit, node) {
+		compile_deps(&b, &unit->requires, CACHE_DEP_REQUIRES);
+		compile_deps(&b, &unit->wants, CACHE_DEP_WANTS);
+		compile_deps(&b, &unit->conflicts, CACHE_DEP_CONFLICTS);
+		compile_deps(&b, &unit->after, CACHE_DEP_AFTER);
+	}
+
+	/* The string table must not be empty */
+	add_string(&b, "", 0);
+
+	if (b.failed)
+		goto out;
+
+	size_t units_len = b.n_units * sizeof(*b.units);
+	size_t deps_len = b.n_deps * sizeof(*b.deps);
+	size_t args_len = b.n_args * sizeof(*b.args);
+	size_t size = sizeof(*cache) + units_len + deps_len + args_len + b.strings_len;
+
+	cache = malloc(size);
+	if (!cache)
+		goto out;
+
+	*cache = (unitd_cache_header_t){
+		.magic = UNITD_CACHE_MAGIC,
+		.version = UNITD_CACHE_VERSION,
+		.size = size,
+		.n_units = b.n_units,
+		.n_deps = b.n_deps,
+		.n_args = b.n_args,
+		.strings_len = b.strings_len,
+	};
+
+	char *p = (char *)(cache + 1);
+	memcpy(p, b.units, units_len);
+	p += units_len;
+	memcpy(p, b.deps, deps_len);
+	p += deps_len;
+	memcpy(p, b.args, args_len);
+	p += args_len;
+	memcpy(p, b.strings, b.strings_len);
+
+	cache->checksum = unitd_cache_checksum(cache + 1, size - sizeof(*cache));
+
+out:
+	builder_free(&b);
+	return cache;
+}
+
+static void write_cache(void) {
+	unitd_cache_header_t *cache;
+	size_t i;
+
+	cache = compile();
+	if (!cache) {
+		ERROR("Unable to compile unit cache\n");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cache_paths); i++) {
+		if (unitd_cache_write(cache_paths[i], cache))
+			break;
+	}
+
+	free(cache);
+}
+
+
+/*
+  Reload
+
+  Only units whose file has changed are reparsed. Their options are
+  replaced and the dependencies declared in their file are unlinked and
+  recreated; unit state, jobs and processes are left alone.
+*/
+
+static void init_unit(unitd_unit_t *unit) {
+	INIT_LIST_HEAD(&unit->requires);
+	INIT_LIST_HEAD(&unit->required_by);
+	INIT_LIST_HEAD(&unit->wants);
+	INIT_LIST_HEAD(&unit->wanted_by);
+	INIT_LIST_HEAD(&unit->conflicts);
+	INIT_LIST_HEAD(&unit->conflicted_by);
+	INIT_LIST_HEAD(&unit->after);
+	INIT_LIST_HEAD(&unit->before);
+}
+
+/* Returns the named unit, registering a placeholder if necessary */
+static unitd_unit_t * get_registered(const char *name) {
+	unitd_cache_storage_t *storage;
+	unitd_unit_t *unit;
+	char *n;
+
+	unit = unitd_unit_find(name);
+	if (unit)
+		return unit;
+
+	storage = calloc_a(sizeof(*storage), &n, strlen(name) + 1);
+	if (!storage)
+		return NULL;
+
+	unit = &storage->unit;
+	unit->type = UNIT_TYPE_TARGET;
+	unit->loaded = LOAD_STATE_NOT_FOUND;
+	unit->name = strcpy(n, name);
+	unit->state = UNIT_STATE_INACTIVE;
+	init_unit(unit);
+
+	unitd_unit_register(unit);
+	return unit;
+}
+
+static void unlink_dep(unitd_dep_t *dep) {
+	list_del(&dep->list_from);
+	list_del(&dep->list_to);
+
+	if (dep->allocated)
+		free(dep);
+}
+
+static void unlink_deps_from(struct list_head *head, unitd_unit_t *owner) {
+	unitd_dep_t *dep, *tmp;
+
+	list_for_each_entry_safe(dep, tmp, head, list_from) {
+		if (dep->owner == owner)
+			unlink_dep(dep);
+	}
+}
+
+static void unlink_deps_to(struct list_head *head, unitd_unit_t *owner) {
+	unitd_dep_t *dep, *tmp;
+
+	list_for_each_entry_safe(dep, tmp, head, list_to) {
+		if (dep->owner == owner)
+			unlink_dep(dep);
+	}
+}
+
+/* Every dependency declared in a unit's file involves the unit itself */
+static void unlink_owned_deps(unitd_unit_t *unit) {
+	unlink_deps_from(&unit->requires, unit);
+	unlink_deps_from(&unit->wants, unit);
+	unlink_deps_from(&unit->conflicts, unit);
+	unlink_deps_from(&unit->after, unit);
+	unlink_deps_to(&unit->required_by, unit);
+	unlink_deps_to(&unit->wanted_by, unit);
+	unlink_deps_to(&unit->conflicted_by, unit);
+	unlink_deps_to(&unit->before, unit);
+}
+
+/* Copies the ExecStart arguments out of the builder into a single allocation */
+static char ** copy_args(const builder_t *b, const unitd_cache_unit_t *cunit) {
+	size_t len = (cunit->n_args + 1) * sizeof(char *);
+	char **args, *p;
+	uint32_t i;
+
+	for (i = 0; i < cunit->n_args; i++)
+		len += strlen(b->strings + b->args[cunit->args + i]) + 1;
+
+	args = malloc(len);
+	if (!args)
+		return NULL;
+
+	p = (char *)(args + cunit->n_args + 1);
+	for (i = 0; i < cunit->n_args; i++) {
+		args[i] = strcpy(p, b->strings + b->args[cunit->args + i]);
+		p += strlen(p) + 1;
+	}
+	args[i] = NULL;
+
+	return args;
+}
+
+static void apply_options(const builder_t *b, unitd_unit_t *unit) {
+	const unitd_cache_unit_t *cunit = &b->units[0];
+	char **args = NULL;
+	char *on_calendar = NULL;
+	unitd_unit_t *target = NULL;
+
+	if (unit->type != cunit->type && unit->state != UNIT_STATE_INACTIVE) {
+		WARN("Not changing the type of active unit %s\n", unit->name);
+		return;
+	}
+
+	if (cunit->type == UNIT_TYPE_TIMER) {
+		target = get_registered(b->strings + b->units[cunit->unit].name);
+		if (cunit->on_calendar != UNITD_CACHE_NO_STRING)
+			on_calendar = strdup(b->strings + cunit->on_calendar);
+
+		if (!target || (cunit->on_calendar != UNITD_CACHE_NO_STRING && !on_calendar)) {
+			ERROR("Unable to reload unit %s: %s\n", unit->name, strerror(ENOMEM));
+			free(on_calendar);
+			unit->loaded = LOAD_STATE_NOT_FOUND;
+			return;
+		}
+	}
+
+	if (unit->type != cunit->type) {
+		/* An inactive service may still have a restart scheduled */
+		if (unit->type == UNIT_TYPE_SERVICE)
+			uloop_timeout_cancel(&container_of(unit, unitd_service_t, unit)->restart);
+
+		memset((char *)unit + sizeof(*unit), 0, sizeof(unitd_cache_storage_t) - sizeof(*unit));
+	}
+
+	if (cunit->type == UNIT_TYPE_TIMER) {
+		/* Changes take effect when the timer is started the next time */
+		unitd_timer_t *timer = container_of(unit, unitd_timer_t, unit);
+		timer->Unit = target;
+		timer->OnCalendar = on_calendar;
+		timer->OnBootSec = cunit->on_boot_sec;
+		timer->OnUnitActiveSec = cunit->on_unit_active_sec;
+		timer->RandomizedDelaySec = cunit->randomized_delay_sec;
+		timer->Persistent = cunit->persistent;
+	} else if (cunit->type == UNIT_TYPE_SERVICE) {
+		args = copy_args(b, cunit);
+		if (!args) {
+			ERROR("Unable to reload unit %s: %s\n", unit->name, strerror(ENOMEM));
+			unit->loaded = LOAD_STATE_NOT_FOUND;
+			return;
+		}
+
+		/* A running process keeps its own copy of the old arguments */
+		unitd_service_t *service = container_of(unit, unitd_service_t, unit);
+		service->type = cunit->service_type;
+		service->ExecStart = args;
+	}
+
+	free(unit->file.data);
+	unit->file.data = args ? (void *)args : (void *)on_calendar;
+
+	unit->type = cunit->type;
+	unit->loaded = cunit->loaded;
+}
+
+static bool reload_unit(int dirfd, const char *name, unitd_unit_type_t type, const unitd_unit_file_t *file) {
+	unitd_unit_t *unit, *from, *to;
+	unitd_dep_t *dep;
+	builder_t b;
+	uint32_t i;
+
+	builder_init(&b);
+
+	if (!parse_file(&b, dirfd, name, type) || b.failed) {
+		builder_free(&b);
+		return false;
+	}
+
+	unit = get_registered(name);
+	if (!unit) {
+		builder_free(&b);
+		return false;
+	}
+
+	DEBUG(2, "Reloading unit %s\n", name);
+
+	unlink_owned_deps(unit);
+	if (!unit->builtin)
+		apply_options(&b, unit);
+
+	for (i = 0; i < b.n_deps; i++) {
+		from = get_registered(b.strings + b.units[b.deps[i].from].name);
+		to = get_registered(b.strings + b.units[b.deps[i].to].name);
+		dep = calloc(1, sizeof(*dep));
+		if (!from || !to || !dep) {
+			ERROR("Unable to add dependency of unit %s\n", name);
+			free(dep);
+			continue;
+		}
+
+		dep->owner = unit;
+		dep->allocated = true;
+		unitd_cache_link_dep(dep, from, to, b.deps[i].type);
+	}
+
+	unit->file.dev = file->dev;
+	unit->file.ino = file->ino;
+	unit->file.size = file->size;
+	unit->file.mtime_sec = file->mtime_sec;
+	unit->file.mtime_nsec = file->mtime_nsec;
+
+	builder_free(&b);
+	return true;
+}
+
+/* Called for units whose file has been removed */
+static void unload_unit(unitd_unit_t *unit) {
+	DEBUG(2, "Unloading unit %s\n", unit->name);
+
+	unlink_owned_deps(unit);
+	if (!unit->builtin)
+		unit->loaded = LOAD_STATE_NOT_FOUND;
+
+	unit->file.dev = 0;
+	unit->file.ino = 0;
+	unit->file.size = 0;
+	unit->file.mtime_sec = 0;
+	unit->file.mtime_nsec = 0;
+}
+
+static bool file_changed(const unitd_unit_file_t *a, const struct stat *st) {
+	return a->dev != (uint64_t)st->st_dev ||
+		a->ino != (uint64_t)st->st_ino ||
+		a->size != (uint64_t)st->st_size ||
+		a->mtime_sec != st->st_mtim.tv_sec ||
+		a->mtime_nsec != st->st_mtim.tv_nsec;
+}
+
+/**
+ * Reparses all unit files that have been added, changed or removed
+ *
+ * Changes are detected by comparing the device, inode, size and mtime of
+ * each unit file with the values recorded when it was last parsed. The
+ * cache is rewritten if anything has changed.
+ *
+ * Returns the number of changed units.
+ */
+int unitd_unit_reload(void) {
+	struct avl_tree seen;
+	builder_name_t *entry, *tmp;
+	unitd_unit_type_t type;
+	unitd_unit_t *unit;
+	struct dirent *ent;
+	struct stat st;
+	int changed = 0;
+	size_t i;
+	DIR *dir;
+	char *key;
+
+	avl_init(&seen, avl_strcmp, false, NULL);
+
+	for (i = 0; i < ARRAY_SIZE(unit_dirs); i++) {
+		dir = opendir(unit_dirs[i]);
+		if (!dir)
+			continue;
+
+		while ((ent = readdir(dir))) {
+			if (!unit_file_type(ent->d_name, &type) || avl_find(&seen, ent->d_name))
+				continue;
+
+			if (fstatat(dirfd(dir), ent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+				continue;
+
+			entry = calloc_a(sizeof(*entry), &key, strlen(ent->d_name) + 1);
+			if (!entry)
+				continue;
+
+			entry->node.key = strcpy(key, ent->d_name);
+			avl_insert(&seen, &entry->node);
+
+			unit = unitd_unit_find(ent->d_name);
+			if (unit && !file_changed(&unit->file, &st))
+				continue;
+
+			unitd_unit_file_t file = {
+				.dev = st.st_dev,
+				.ino = st.st_ino,
+				.size = st.st_size,
+				.mtime_sec = st.st_mtim.tv_sec,
+				.mtime_nsec = st.st_mtim.tv_nsec,
+			};
+			if (reload_unit(dirfd(dir), ent->d_name, type, &file))
+				changed++;
+		}
+
+		closedir(dir);
+	}
+
+	avl_for_each_element(&units, unit, node) {
+		if (unit->file.ino && !avl_find(&seen, unit->name)) {
+			unload_unit(unit);
+			changed++;
+		}
+	}
+
+	avl_remove_all_elements(&seen, entry, node, tmp)
+		free(entry);
+
+	if (changed) {
+		DEBUG(1, "Reloaded %d changed units\n", changed);
+		write_cache();
+	}
+
+	return changed;
+}
+
+
+/* Unit directory watches */
+
+static void reload_timeout_cb(struct uloop_timeout *timeout) {
+	unitd_unit_reload();
+}
+
+static struct uloop_timeout reload_timeout = {
+	.cb = reload_timeout_cb,
+};
+
+static void watch_cb(struct uloop_fd *fd, unsigned int events) {
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	/* The events only trigger a reload, which finds the changes itself */
+	while (read(fd->fd, buf, sizeof(buf)) > 0) {}
+
+	uloop_timeout_set(&reload_timeout, RELOAD_DELAY);
+}
+
+static struct uloop_fd watch = {
+	.cb = watch_cb,
+};
+
+/* Directories that do not exist yet are not watched; use unitctl daemon-reload */
+static void watch_init(void) {
+	size_t i;
+
+	watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch.fd < 0) {
+		ERROR("Unable to watch unit directories: %s\n", strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(unit_dirs); i++)
+		inotify_add_watch(watch.fd, unit_dirs[i],
+				  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+				  IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR);
+
+	uloop_fd_add(&watch, ULOOP_READ);
+}
+
+
+/**
+ * Loads all units
+ *
+ * The cache is instantiated first, then all unit files that differ from
+ * the cached ones are reparsed. Must be called after the built-in units
+ * have been registered.
+ */
+void unitd_unit_load(void) {
+	const unitd_cache_header_t *cache;
+	size_t i, len;
+
+	for (i = 0; i < ARRAY_SIZE(cache_paths); i++) {
+		cache = unitd_cache_map(cache_paths[i], &len);
+		if (!cache)
+			continue;
+
+		/* The units point into the cache, so it stays mapped */
+		if (unitd_cache_valid(cache, len) && !unitd_cache_instantiate(cache))
+			break;
+
+		munmap((void *)cache, len);
+	}
+
+	unitd_unit_reload();
+	watch_init();
+}
@@ -29,9 +29,42 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 
+/* Delay before a service is restarted after its process has exited, in ms */
+#define SERVICE_RESTART_DELAY 1000
+
+/* A service is not started more than SERVICE_START_LIMIT_BURST times per interval */
+#define SERVICE_START_LIMIT_BURST 5
+#define SERVICE_START_LIMIT_INTERVAL 10000
+
+
+static uint64_t now_monotonic(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool start_limit_hit(unitd_service_t *service) {
+	uint64_t now = now_monotonic();
+
+	if (!service->start_count || now - service->start_interval >= SERVICE_START_LIMIT_INTERVAL) {
+		service->start_interval = now;
+		service->start_count = 0;
+	}
+
+	return ++service->start_count > SERVICE_START_LIMIT_BURST;
+}
+
+static void on_service_restart(struct uloop_timeout *t) {
+	unitd_service_t *service = container_of(t, unitd_service_t, restart);
+
+	unitd_unit_activate(&service->unit);
+}
+
 static void on_service_exit(struct uloop_process *p, int ret) {
         unitd_service_t *service = container_of(p, unitd_service_t, proc);
 
@@ -41,7 +74,8 @@ static void on_service_exit(struct uloop_process *p, int ret) {
         service->unit.state = UNIT_STATE_INACTIVE;
 
         /* TODO: Make restart conditional */
-	unitd_unit_activate(&service->unit);
+	service->restart.cb = on_service_restart;
+	uloop_timeout_set(&service->restart, SERVICE_RESTART_DELAY);
 }
 
 static void service_exec(unitd_service_t *service) {
@@ -54,6 +88,11 @@ static void service_exec(unitd_service_t *service) {
 }
 
 static bool service_run(unitd_service_t *service) {
+	if (start_limit_hit(service)) {
+		ERROR("Service %s is started too often, giving up\n", service->unit.name);
+		return false;
+	}
+
         service->proc.cb = on_service_exit;
         service->proc.pid = fork();
 
@@ -82,9 +121,17 @@ void unitd_service_start(unitd_service_t *service) {
 
                 return;
 
+        case SERVICE_TYPE_NOTIFY:
+                /* Becomes active when unitd_service_ready() is called */
+                if (service_run(service))
+                        service->unit.state = UNIT_STATE_ACTIVATING;
+                else
+                        service->unit.state = UNIT_STATE_FAILED;
+
+                return;
+
         case SERVICE_TYPE_FORKING:
         case SERVICE_TYPE_ONESHOT:
-        case SERVICE_TYPE_NOTIFY:
 		service->unit.state = UNIT_STATE_ACTIVATING;
                 return;
 
@@ -93,6 +140,18 @@ void unitd_service_start(unitd_service_t *service) {
         }
 }
 
+void unitd_service_ready(unitd_service_t *service) {
+	if (service->unit.state != UNIT_STATE_ACTIVATING)
+		return;
+
+	LOG("Service %s is ready\n", service->unit.name);
+	service->unit.state = UNIT_STATE_ACTIVE;
+
+	/* Start the units ordered after this one */
+	unitd_unit_wakeup_pending();
+}
+
 void unitd_service_stop(unitd_service_t *service) {
+	uloop_timeout_cancel(&service->restart);
 	service->unit.state = UNIT_STATE_DEACTIVATING;
 }
@@ -0,0 +1,231 @@
+/*
+  Copyright (c) 2015, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../log.h"
+#include "unit.h"
+
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define TIMER_STAMP_DIR "/var/lib/unitd/timers"
+
+
+static uint64_t now_monotonic(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned random_delay(unitd_timer_t *timer) {
+	uint32_t r;
+
+	if (!timer->RandomizedDelaySec)
+		return 0;
+
+	if (getrandom(&r, sizeof(r), GRND_NONBLOCK) != sizeof(r))
+		r = random();
+
+	return r % (timer->RandomizedDelaySec * 1000);
+}
+
+static void stamp_path(unitd_timer_t *timer, char *path, size_t len) {
+	snprintf(path, len, TIMER_STAMP_DIR "/%s", timer->unit.name);
+}
+
+static time_t stamp_read(unitd_timer_t *timer) {
+	char path[256];
+	struct stat st;
+
+	stamp_path(timer, path, sizeof(path));
+	if (stat(path, &st))
+		return 0;
+
+	return st.st_mtime;
+}
+
+static void stamp_write(unitd_timer_t *timer) {
+	char path[256];
+	int fd;
+
+	mkdir("/var/lib", 0755);
+	mkdir("/var/lib/unitd", 0755);
+	mkdir(TIMER_STAMP_DIR, 0755);
+
+	stamp_path(timer, path, sizeof(path));
+	fd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		WARN("Unable to write timestamp of timer %s: %s\n", timer->unit.name, strerror(errno));
+		return;
+	}
+
+	futimens(fd, NULL);
+	close(fd);
+}
+
+static void timer_trigger(unitd_timer_t *timer) {
+	LOG("Timer %s elapsed, activating unit %s\n", timer->unit.name, timer->Unit->name);
+
+	timer->last_trigger = now_monotonic();
+	if (timer->Persistent)
+		stamp_write(timer);
+
+	unitd_unit_activate(timer->Unit);
+}
+
+static void arm_monotonic(unitd_timer_t *timer) {
+	uint64_t now = now_monotonic(), next = UINT64_MAX;
+
+	if (timer->OnBootSec && !timer->boot_elapsed)
+		next = (uint64_t)timer->OnBootSec * 1000;
+
+	if (timer->OnUnitActiveSec && timer->last_trigger) {
+		uint64_t t = timer->last_trigger + (uint64_t)timer->OnUnitActiveSec * 1000;
+		if (t < next)
+			next = t;
+	}
+
+	if (next == UINT64_MAX) {
+		uloop_timeout_cancel(&timer->monotonic);
+		return;
+	}
+
+	next = (next > now) ? next - now : 0;
+	uloop_timeout_set(&timer->monotonic, next + random_delay(timer));
+}
+
+static void arm_realtime(unitd_timer_t *timer) {
+	struct itimerspec its = {};
+	time_t next;
+	unsigned delay;
+
+	if (!unitd_calendar_next(&timer->calendar, time(NULL), &next)) {
+		WARN("Timer %s will never elapse\n", timer->unit.name);
+		return;
+	}
+
+	delay = random_delay(timer);
+	its.it_value.tv_sec = next + delay / 1000;
+	its.it_value.tv_nsec = (delay % 1000) * 1000000;
+
+	/* TFD_TIMER_CANCEL_ON_SET lets us recompute the elapse time when the
+	   clock is set, which is common on devices without RTC */
+	if (timerfd_settime(timer->realtime.fd, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET, &its, NULL))
+		ERROR("Unable to arm timer %s: timerfd_settime: %s\n", timer->unit.name, strerror(errno));
+}
+
+static void on_monotonic(struct uloop_timeout *t) {
+	unitd_timer_t *timer = container_of(t, unitd_timer_t, monotonic);
+
+	if (timer->OnBootSec && now_monotonic() >= (uint64_t)timer->OnBootSec * 1000)
+		timer->boot_elapsed = true;
+
+	timer_trigger(timer);
+	arm_monotonic(timer);
+}
+
+static void on_realtime(struct uloop_fd *fd, unsigned int events) {
+	unitd_timer_t *timer = container_of(fd, unitd_timer_t, realtime);
+	uint64_t expirations;
+
+	if (read(fd->fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return;
+		if (errno != ECANCELED)
+			ERROR("Unable to read timer %s: %s\n", timer->unit.name, strerror(errno));
+
+		/* The clock was set, reschedule */
+		arm_realtime(timer);
+		return;
+	}
+
+	timer_trigger(timer);
+
+	/* Don't let a trigger in the past of the monotonic part go unnoticed */
+	arm_monotonic(timer);
+	arm_realtime(timer);
+}
+
+static bool start_realtime(unitd_timer_t *timer) {
+	time_t last, next;
+
+	if (!unitd_calendar_parse(&timer->calendar, timer->OnCalendar)) {
+		ERROR("Invalid calendar specification for timer %s: %s\n", timer->unit.name, timer->OnCalendar);
+		return false;
+	}
+
+	timer->realtime.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (timer->realtime.fd < 0) {
+		ERROR("Unable to start timer %s: timerfd_create: %s\n", timer->unit.name, strerror(errno));
+		return false;
+	}
+
+	timer->realtime.cb = on_realtime;
+	uloop_fd_add(&timer->realtime, ULOOP_READ);
+
+	/* Catch up on an elapse that was missed while the system was down */
+	if (timer->Persistent) {
+		last = stamp_read(timer);
+		if (last && unitd_calendar_next(&timer->calendar, last, &next) && next <= time(NULL)) {
+			LOG("Timer %s missed its last elapse, catching up\n", timer->unit.name);
+			timer_trigger(timer);
+		}
+	}
+
+	arm_realtime(timer);
+	return true;
+}
+
+void unitd_timer_start(unitd_timer_t *timer) {
+	timer->monotonic.cb = on_monotonic;
+
+	if (timer->OnCalendar && !start_realtime(timer)) {
+		timer->unit.state = UNIT_STATE_FAILED;
+		return;
+	}
+
+	timer->unit.state = UNIT_STATE_ACTIVE;
+	arm_monotonic(timer);
+}
+
+void unitd_timer_stop(unitd_timer_t *timer) {
+	uloop_timeout_cancel(&timer->monotonic);
+
+	if (timer->realtime.registered) {
+		uloop_fd_delete(&timer->realtime);
+		close(timer->realtime.fd);
+	}
+
+	timer->unit.state = UNIT_STATE_INACTIVE;
+}
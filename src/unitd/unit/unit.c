@@ -70,6 +70,36 @@ static bool deactivate_service(unitd_unit_t *unit) {
 	}
 }
 
+static bool activate_timer(unitd_unit_t *unit) {
+	switch (unit->state) {
+	case UNIT_STATE_ACTIVE:
+		return true;
+
+	case UNIT_STATE_INACTIVE:
+	case UNIT_STATE_FAILED:
+		unitd_timer_start(container_of(unit, unitd_timer_t, unit));
+		return true;
+
+	default:
+		BUG("invalid timer state");
+	}
+}
+
+static bool deactivate_timer(unitd_unit_t *unit) {
+	switch (unit->state) {
+	case UNIT_STATE_INACTIVE:
+	case UNIT_STATE_FAILED:
+		return true;
+
+	case UNIT_STATE_ACTIVE:
+		unitd_timer_stop(container_of(unit, unitd_timer_t, unit));
+		return true;
+
+	default:
+		BUG("invalid timer state");
+	}
+}
+
 static bool do_activate(unitd_unit_t *unit) {
 	LOG("Will now start unit %s\n", unit->name);
 
@@ -81,6 +111,9 @@ static bool do_activate(unitd_unit_t *unit) {
 	case UNIT_TYPE_SERVICE:
 		return activate_service(unit);
 
+	case UNIT_TYPE_TIMER:
+		return activate_timer(unit);
+
 	default:
 		BUG("invalid service type");
 	}
@@ -97,6 +130,9 @@ static bool do_deactivate(unitd_unit_t *unit) {
 	case UNIT_TYPE_SERVICE:
 		return deactivate_service(unit);
 
+	case UNIT_TYPE_TIMER:
+		return deactivate_timer(unit);
+
 	default:
 		BUG("invalid service type");
 	}
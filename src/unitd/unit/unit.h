@@ -25,10 +25,13 @@
 
 #pragma once
 
+#include <libubox/avl.h>
 #include <libubox/list.h>
 #include <libubox/uloop.h>
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 
 typedef struct unitd_unit unitd_unit_t;
@@ -47,12 +50,16 @@ typedef struct unitd_dep {
 
 	struct list_head list_from;	/**< List head for the "from" list */
 	struct list_head list_to;	/**< List head for the "to" list */
+
+	unitd_unit_t *owner;		/**< Unit whose file declares the dependency, NULL for built-in ones */
+	bool allocated;			/**< Allocated on its own rather than as part of a cache */
 } unitd_dep_t;
 
 
 typedef enum unitd_unit_type {
 	UNIT_TYPE_TARGET,
 	UNIT_TYPE_SERVICE,
+	UNIT_TYPE_TIMER,
 } unitd_unit_type_t;
 
 
@@ -62,6 +69,18 @@ typedef enum unitd_load_state {
 } unitd_load_state_t;
 
 
+/** The unit file a unit was loaded from, used to detect changes on reload */
+typedef struct unitd_unit_file {
+	uint64_t dev;
+	uint64_t ino;			/**< 0 if the unit was not loaded from a file */
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+
+	void *data;			/**< Options allocated on reload, NULL if they point into the cache */
+} unitd_unit_file_t;
+
+
 typedef enum unitd_unit_state {
 	UNIT_STATE_INACTIVE = 0,
 	UNIT_STATE_ACTIVE,
@@ -78,8 +97,12 @@ struct unitd_unit {
 	unitd_load_state_t loaded;
 
 	struct list_head list;
+	struct avl_node node;		/**< Node in the unit registry, keyed by name */
 	char *name;
 
+	bool builtin;			/**< Unit files can add dependencies, but not change options */
+	unitd_unit_file_t file;
+
 	struct list_head requires;
 	struct list_head required_by;
 	struct list_head wants;
@@ -116,9 +139,41 @@ typedef struct unitd_service {
 
 	/* Instance state */
 	struct uloop_process proc;
+	struct uloop_timeout restart;	/**< Delayed restart after the process has exited */
+	unsigned start_count;		/**< Starts in the current start limit interval */
+	uint64_t start_interval;	/**< Monotonic time of the first start in the interval in ms */
 } unitd_service_t;
 
 
+typedef struct unitd_calendar {
+	uint64_t second;		/**< Bitmask of matching seconds (0-59) */
+	uint64_t minute;		/**< Bitmask of matching minutes (0-59) */
+	uint32_t hour;			/**< Bitmask of matching hours (0-23) */
+	uint32_t mday;			/**< Bitmask of matching days of the month (1-31) */
+	uint16_t month;			/**< Bitmask of matching months (1-12) */
+	uint8_t wday;			/**< Bitmask of matching weekdays (0-6, starting with Sunday) */
+} unitd_calendar_t;
+
+typedef struct unitd_timer {
+	unitd_unit_t unit;
+
+	/* Timer options */
+	unitd_unit_t *Unit;		/**< The unit to activate when the timer elapses */
+	const char *OnCalendar;
+	unsigned OnBootSec;
+	unsigned OnUnitActiveSec;
+	unsigned RandomizedDelaySec;
+	bool Persistent;
+
+	/* Timer state */
+	unitd_calendar_t calendar;
+	struct uloop_timeout monotonic;	/**< Timeout for OnBootSec and OnUnitActiveSec */
+	struct uloop_fd realtime;	/**< timerfd for OnCalendar */
+	bool boot_elapsed;
+	uint64_t last_trigger;		/**< Monotonic time of the last trigger in ms, 0 if never triggered */
+} unitd_timer_t;
+
+
 typedef struct unitd_transaction {
 	struct list_head jobs;
 } unitd_transaction_t;
@@ -127,14 +182,26 @@ typedef struct unitd_transaction {
 extern struct list_head unitd_pending_units;
 
 
+unitd_unit_t * unitd_unit_find(const char *name);
+void unitd_unit_register(unitd_unit_t *unit);
+void unitd_unit_load(void);
+int unitd_unit_reload(void);
+
 int unitd_unit_activate(unitd_unit_t *unit);
 int unitd_unit_deactivate(unitd_unit_t *unit);
 
 void unitd_unit_wakeup_pending(void);
 
 void unitd_service_start(unitd_service_t *service);
+void unitd_service_ready(unitd_service_t *service);
 void unitd_service_stop(unitd_service_t *service);
 
+void unitd_timer_start(unitd_timer_t *timer);
+void unitd_timer_stop(unitd_timer_t *timer);
+
+bool unitd_calendar_parse(unitd_calendar_t *cal, const char *spec);
+bool unitd_calendar_next(const unitd_calendar_t *cal, time_t after, time_t *next);
+
 
 static inline void unitd_unit_add_pending(unitd_unit_t *unit, unitd_job_type_t type) {
 	if (unit->pending_type)
@@ -35,6 +35,8 @@ void unitd_early(void);
 void unitd_connect_ubus(void);
 void unitd_reconnect_ubus(int reconnect);
 void ubus_init_service(struct ubus_context *ctx);
+void ubus_disconnect_service(void);
+void ubus_reconnect_service(void);
 void ubus_init_system(struct ubus_context *ctx);
 
 void unitd_state_next(void);
@@ -46,4 +48,6 @@ void unitd_coldplug(void);
 void unitd_signal(void);
 void unitd_signal_preinit(void);
 void unitd_askconsole(void);
+void unitd_boot(void);
+void unitd_boot_ubus_ready(void);
 void unitd_bcast_event(char *event, struct blob_attr *msg);
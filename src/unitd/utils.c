@@ -17,9 +17,6 @@
 
 #include "utils.h"
 
-#include <libubox/avl.h>
-#include <libubox/avl-cmp.h>
-
 #include <asm-generic/setup.h>
 #include <regex.h>
 #include <unistd.h>
@@ -30,86 +27,157 @@
 void
 __blobmsg_list_init(struct blobmsg_list *list, int offset, int len, blobmsg_list_cmp cmp)
 {
-	avl_init(&list->avl, avl_strcmp, false, NULL);
+	list->nodes = NULL;
+	list->count = 0;
+	list->external = false;
 	list->node_offset = offset;
 	list->node_len = len;
 	list->cmp = cmp;
 }
 
+static const char *
+blobmsg_list_key(struct blob_attr *cur, bool array)
+{
+	return array ? blobmsg_data(cur) : blobmsg_name(cur);
+}
+
 int
-blobmsg_list_fill(struct blobmsg_list *list, void *data, int len, bool array)
+blobmsg_list_count(void *data, int len, bool array)
 {
-	struct avl_tree *tree = &list->avl;
-	struct blobmsg_list_node *node;
 	struct blob_attr *cur;
-	void *ptr;
 	int count = 0;
 	int rem = len;
 
 	__blob_for_each_attr(cur, data, rem) {
-		if (!blobmsg_check_attr(cur, !array))
-			continue;
+		if (blobmsg_check_attr(cur, !array))
+			count++;
+	}
+
+	return count;
+}
+
+/* Finds the index of key, or the index it would need to be inserted at */
+static bool
+blobmsg_list_find_pos(struct blobmsg_list *list, const char *key, int *pos)
+{
+	int min = 0, max = list->count;
 
-		ptr = calloc(1, list->node_len);
-		if (!ptr)
-			return -1;
+	while (min < max) {
+		int mid = (min + max) / 2;
+		int cmp = strcmp(key, __blobmsg_list_node(list, mid)->key);
 
-		node = (void *) ((char *)ptr + list->node_offset);
-		if (array)
-			node->avl.key = blobmsg_data(cur);
+		if (!cmp) {
+			*pos = mid;
+			return true;
+		}
+
+		if (cmp < 0)
+			max = mid;
 		else
-			node->avl.key = blobmsg_name(cur);
-		node->data = cur;
-		if (avl_insert(tree, &node->avl)) {
-			free(ptr);
+			min = mid + 1;
+	}
+
+	*pos = min;
+	return false;
+}
+
+/*
+ * Fills the list using buf as storage, which must have room for
+ * blobmsg_list_count() elements. Duplicate keys are skipped.
+ */
+int
+blobmsg_list_fill_buf(struct blobmsg_list *list, void *buf, void *data, int len, bool array)
+{
+	struct blobmsg_list_node *node;
+	struct blob_attr *cur;
+	int rem = len;
+
+	blobmsg_list_free(list);
+	list->nodes = buf;
+	list->external = true;
+
+	__blob_for_each_attr(cur, data, rem) {
+		const char *key;
+		char *ptr;
+		int pos;
+
+		if (!blobmsg_check_attr(cur, !array))
 			continue;
-		}
 
-		count++;
+		key = blobmsg_list_key(cur, array);
+		if (blobmsg_list_find_pos(list, key, &pos))
+			continue;
+
+		ptr = (char *) list->nodes + pos * list->node_len;
+		memmove(ptr + list->node_len, ptr, (list->count - pos) * list->node_len);
+		memset(ptr, 0, list->node_len);
+
+		node = (void *) (ptr + list->node_offset);
+		node->key = key;
+		node->data = cur;
+		list->count++;
 	}
 
+	return list->count;
+}
+
+int
+blobmsg_list_fill(struct blobmsg_list *list, void *data, int len, bool array)
+{
+	int count = blobmsg_list_count(data, len, array);
+	void *buf;
+
+	blobmsg_list_free(list);
+	if (!count)
+		return 0;
+
+	buf = calloc(count, list->node_len);
+	if (!buf)
+		return -1;
+
+	count = blobmsg_list_fill_buf(list, buf, data, len, array);
+	list->external = false;
+
 	return count;
 }
 
+/* Replaces the contents of list with the contents of src, leaving src empty */
 void
 blobmsg_list_move(struct blobmsg_list *list, struct blobmsg_list *src)
 {
-	struct blobmsg_list_node *node, *tmp;
-	void *ptr;
+	blobmsg_list_free(list);
 
-	avl_remove_all_elements(&src->avl, node, avl, tmp) {
-		if (avl_insert(&list->avl, &node->avl)) {
-			ptr = ((char *) node - list->node_offset);
-			free(ptr);
-		}
-	}
+	list->nodes = src->nodes;
+	list->count = src->count;
+	list->external = src->external;
+
+	src->nodes = NULL;
+	src->count = 0;
+	src->external = false;
 }
 
 void
 blobmsg_list_free(struct blobmsg_list *list)
 {
-	struct blobmsg_list_node *node, *tmp;
-	void *ptr;
+	if (!list->external)
+		free(list->nodes);
 
-	avl_remove_all_elements(&list->avl, node, avl, tmp) {
-		ptr = ((char *) node - list->node_offset);
-		free(ptr);
-	}
+	list->nodes = NULL;
+	list->count = 0;
+	list->external = false;
 }
 
 bool
 blobmsg_list_equal(struct blobmsg_list *l1, struct blobmsg_list *l2)
 {
-	struct blobmsg_list_node *n1, *n2;
-	int count = l1->avl.count;
+	int i;
 
-	if (count != (int)l2->avl.count)
+	if (l1->count != l2->count)
 		return false;
 
-	n1 = avl_first_element(&l1->avl, n1, avl);
-	n2 = avl_first_element(&l2->avl, n2, avl);
-
-	while (count-- > 0) {
+	for (i = 0; i < l1->count; i++) {
+		struct blobmsg_list_node *n1 = __blobmsg_list_node(l1, i);
+		struct blobmsg_list_node *n2 = __blobmsg_list_node(l2, i);
 		unsigned int len;
 
 		len = blob_len(n1->data);
@@ -121,12 +189,6 @@ blobmsg_list_equal(struct blobmsg_list *l1, struct blobmsg_list *l2)
 
 		if (l1->cmp && !l1->cmp(n1, n2))
 			return false;
-
-		if (!count)
-			break;
-
-		n1 = avl_next_element(n1, avl);
-		n2 = avl_next_element(n2, avl);
 	}
 
 	return true;
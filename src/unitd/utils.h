@@ -17,22 +17,29 @@
 
 #pragma once
 
-#include <libubox/avl.h>
 #include <libubox/blob.h>
 #include <libubox/blobmsg.h>
 
 #define CMDLINE_SIZE 2048
 
 struct blobmsg_list_node {
-	struct avl_node avl;
+	const char *key;
 	struct blob_attr *data;
 };
 
 typedef bool (*blobmsg_list_cmp)(struct blobmsg_list_node *l1, struct blobmsg_list_node *l2);
 typedef void (*blobmsg_update_cb)(struct blobmsg_list_node *n);
 
+/*
+ * A blobmsg_list is a flat array of count elements of node_len bytes, sorted
+ * by key. The array is either owned by the list or, when filled using
+ * blobmsg_list_fill_buf(), part of a larger buffer owned by the caller.
+ */
 struct blobmsg_list {
-	struct avl_tree avl;
+	void *nodes;
+	int count;
+	bool external;
+
 	int node_offset;
 	int node_len;
 
@@ -46,9 +53,40 @@ struct blobmsg_list {
 	__blobmsg_list_init(list, offsetof(type, field), sizeof(type), cmp)
 
 #define blobmsg_list_for_each(list, element) \
-	avl_for_each_element(&(list)->avl, element, avl)
+	for (element = blobmsg_list_first(list); element; element = blobmsg_list_next(list, element))
+
+static inline struct blobmsg_list_node *
+__blobmsg_list_node(struct blobmsg_list *list, int i)
+{
+	return (struct blobmsg_list_node *) ((char *) list->nodes + i * list->node_len + list->node_offset);
+}
+
+static inline struct blobmsg_list_node *
+blobmsg_list_first(struct blobmsg_list *list)
+{
+	return list->count ? __blobmsg_list_node(list, 0) : NULL;
+}
+
+static inline struct blobmsg_list_node *
+blobmsg_list_next(struct blobmsg_list *list, struct blobmsg_list_node *node)
+{
+	struct blobmsg_list_node *next = (void *) ((char *) node + list->node_len);
+
+	if (next > __blobmsg_list_node(list, list->count - 1))
+		return NULL;
+
+	return next;
+}
+
+static inline bool
+blobmsg_list_empty(struct blobmsg_list *list)
+{
+	return !list->count;
+}
 
 void __blobmsg_list_init(struct blobmsg_list *list, int offset, int len, blobmsg_list_cmp cmp);
+int blobmsg_list_count(void *data, int len, bool array);
+int blobmsg_list_fill_buf(struct blobmsg_list *list, void *buf, void *data, int len, bool array);
 int blobmsg_list_fill(struct blobmsg_list *list, void *data, int len, bool array);
 void blobmsg_list_free(struct blobmsg_list *list);
 bool blobmsg_list_equal(struct blobmsg_list *l1, struct blobmsg_list *l2);